@@ -0,0 +1,192 @@
+/* *
+ * MIT License
+ *
+ * Copyright (c) 2018 University of Massachusetts Lowell
+ * Written by Daniel Santos
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * */
+// Measures the overhead of the framework itself. Every result is printed as
+// one "name<TAB>value<TAB>unit" line so runs can be diffed or tracked.
+#include <iostream>
+#include "../mtest.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+// Discards everything, so reporting is measured without the terminal
+class NullBuffer : public std::streambuf
+{
+protected:
+  int_type overflow(int_type c) override
+  {
+    return c;
+  }
+
+  std::streamsize xsputn(const char *, std::streamsize n) override
+  {
+    return n;
+  }
+};
+
+static NullBuffer nullBuffer;
+static std::ostream null(&nullBuffer);
+
+static void print(const std::string &name, double value, const char *unit)
+{
+  std::cout << name << '\t' << value << '\t' << unit << std::endl;
+}
+
+static double seconds(Clock::time_point begin)
+{
+  return std::chrono::duration<double>(Clock::now() - begin).count();
+}
+
+// Runs one test making n assertions of the given outcome, with expect_eq or
+// with MT_CHECK, and traced when sampling is not zero
+static void assertions(const std::string &name, std::size_t n, bool pass,
+                       bool decomposed = false, std::size_t sampling = 0)
+{
+  static std::size_t count;
+  static bool passing;
+  count = n;
+  passing = pass;
+
+  MTEnv env;
+  if (sampling != 0)
+    env.trace_to("/dev/null", sampling);
+  if (decomposed)
+  {
+    env.add_test("assertions", "", [](MTEnv &env) {
+      for (std::size_t i = 0; i < count; i++)
+        MT_CHECK(int(i) == (passing ? int(i) : -1));
+    });
+  }
+  else
+  {
+    env.add_test("assertions", "", [](MTEnv &env) {
+      for (std::size_t i = 0; i < count; i++)
+        env.expect_eq<int>(int(i), passing ? int(i) : -1);
+    });
+  }
+
+  Clock::time_point begin = Clock::now();
+  env.run_all(false);
+  print(name, seconds(begin) * 1e9 / n, "ns/assertion");
+}
+
+static void emptyTest(MTEnv &)
+{
+}
+
+static void registration(std::size_t n)
+{
+  {
+    MTEnv env;
+    Clock::time_point begin = Clock::now();
+    for (std::size_t i = 0; i < n; i++)
+      env.add_test("test", "feedback", emptyTest);
+    print("add_test/plain/" + std::to_string(n), seconds(begin) * 1e9 / n, "ns/test");
+  }
+
+  {
+    MTEnv env;
+    Clock::time_point begin = Clock::now();
+    for (std::size_t i = 0; i < n; i++)
+      env.add_test("test", "feedback", [i](MTEnv &env) { env.expect_true(i >= 0); });
+    print("add_test/capture/" + std::to_string(n), seconds(begin) * 1e9 / n, "ns/test");
+  }
+}
+
+// n tests with k failing records each, run with and without reporting
+static void reporting(std::size_t n, std::size_t k)
+{
+  static std::size_t perTest;
+  perTest = k;
+
+  double time[2];
+  for (int report = 0; report < 2; report++)
+  {
+    MTEnv env;
+    env.add_reporter(std::make_unique<MTConsoleReporter>(null));
+    env.add_reporter(std::make_unique<MTJsonLinesReporter>(null));
+    for (std::size_t i = 0; i < n; i++)
+    {
+      env.add_test("test", "feedback", [](MTEnv &env) {
+        for (std::size_t j = 0; j < perTest; j++)
+          env.expect_eq<int>(int(j), -1);
+      });
+    }
+
+    Clock::time_point begin = Clock::now();
+    env.run_all(report == 1);
+    time[report] = seconds(begin);
+  }
+
+  std::string records = std::to_string(n * k);
+  print("report/records/" + records, (time[1] - time[0]) * 1e9 / (n * k), "ns/record");
+}
+
+// A fixed amount of work per test, spread over more and more threads
+static void scaling(std::size_t n)
+{
+  MTEnv env;
+  for (std::size_t i = 0; i < n; i++)
+  {
+    env.add_test("work", "", [](MTEnv &env) {
+      std::uint64_t x = 1;
+      for (int j = 0; j < 20000; j++)
+        x = x * 6364136223846793005ull + 1442695040888963407ull;
+      env.do_not_optimize(x);
+      env.expect_true(true);
+    });
+  }
+
+  double base = 0;
+  for (unsigned int threads = 1; threads <= 64; threads *= 2)
+  {
+    Clock::time_point begin = Clock::now();
+    env.run_all_parallel(threads, false);
+    double time = seconds(begin);
+    if (threads == 1)
+      base = time;
+
+    std::string name = "parallel/threads/" + std::to_string(threads);
+    print(name, time * 1e6 / n, "us/test");
+    print(name + "/speedup", base / time, "x");
+  }
+}
+
+int main()
+{
+  assertions("expect_eq/pass", 10000000, true);
+  assertions("expect_eq/fail", 1000000, false);
+  assertions("MT_CHECK/pass", 10000000, true, true);
+  assertions("MT_CHECK/fail", 1000000, false, true);
+  assertions("expect_eq/pass/traced/1000", 10000000, true, false, 1000);
+  assertions("expect_eq/pass/traced/1", 1000000, true, false, 1);
+
+  for (std::size_t n : {10000, 100000, 1000000})
+    registration(n);
+
+  reporting(10000, 10);
+  reporting(1000, 1000);
+
+  scaling(4096);
+  return 0;
+}
@@ -131,6 +131,12 @@ int main(int argc, char const *argv[])
     })
   );
 
+  // Tests that only need env can skip the tuple and std::function entirely
+  ge.add_test(test_s("Static test", "Feedback", {
+    env.expect_eq<int>(4, 4);
+  }));
+  ge.add_test("Function pointer", "Error message", exampleTest);
+
   // Run all tests
   ge.run_all(true, true);
 
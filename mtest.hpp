@@ -23,318 +23,5986 @@
  * SOFTWARE.
  * */
 
+#ifndef MTEST_HPP
+#define MTEST_HPP
+
 #include <functional>
 #include <initializer_list>
-#include <any>
 #include <vector>
 #include <map>
+#include <set>
 #include <sstream>
+#include <streambuf>
 #include <iostream>
+#include <fstream>
+#include <iterator>
 #include <cmath>
 #include <memory>
 #include <optional>
+#include <string_view>
+#include <type_traits>
+#include <climits>
+#include <limits>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <atomic>
+#include <stdexcept>
+#include <algorithm>
+#include <numeric>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstddef>
+#include <new>
+#include <utility>
+
+#if __cplusplus >= 202002L
+#include <bit>
+#endif
+
+// <regex> is by far the costliest header to parse and only --regex needs it.
+// Define MT_NO_REGEX to leave it out. Set it for the whole program with -D,
+// not per file: every translation unit must see the same header.
+#ifndef MT_NO_REGEX
+#include <regex>
+#endif
+
+#if defined(__has_include)
+#if __has_include(<source_location>)
+#include <source_location>
+#endif
+#endif
+
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#include <coroutine>
+#define MT_HAS_COROUTINES 1
+#endif
+#endif
+
+#if defined(__cpp_lib_bit_cast)
+#define MT_BIT_CAST_CONSTEXPR constexpr
+#else
+#define MT_BIT_CAST_CONSTEXPR
+#endif
+
+// MT_CHECK chains comparisons on purpose, e.g. MTDecomposer{} <= a == b
+#if defined(__GNUC__)
+#define MT_IGNORE_PARENTHESES_BEGIN \
+  _Pragma("GCC diagnostic push") _Pragma("GCC diagnostic ignored \"-Wparentheses\"")
+#define MT_IGNORE_PARENTHESES_END _Pragma("GCC diagnostic pop")
+#else
+#define MT_IGNORE_PARENTHESES_BEGIN
+#define MT_IGNORE_PARENTHESES_END
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#define MT_HAS_FORK 1
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#endif
+
+// Heap allocations and frees made by the calling thread. They are only
+// counted when MT_TRACK_ALLOCATIONS is defined before including this header,
+// which replaces the global operator new and delete. Do that in a single
+// translation unit of the program, the one with main.
+struct MTAllocations
+{
+  static inline thread_local std::uint64_t count = 0;
+  static inline thread_local std::uint64_t bytes = 0;
+  static inline thread_local std::uint64_t frees = 0;
+  static inline thread_local std::uint64_t freedBytes = 0;
+
+  // Set when the replacement operators are linked in
+  static inline bool enabled = false;
+
+  // Every block is preceded by its size so delete can account for it
+  static constexpr std::size_t header = alignof(std::max_align_t);
+};
+
+#ifdef MT_TRACK_ALLOCATIONS
+// GCC sees free() on memory from operator new once both are inlined
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+static const bool _mtAllocationsEnabled = (MTAllocations::enabled = true);
+
+void *operator new(std::size_t size)
+{
+  MTAllocations::count++;
+  MTAllocations::bytes += size;
+  if (char *p = static_cast<char *>(std::malloc(MTAllocations::header + size)))
+  {
+    std::memcpy(p, &size, sizeof(size));
+    return p + MTAllocations::header;
+  }
+  throw std::bad_alloc();
+}
+
+void *operator new[](std::size_t size)
+{
+  return operator new(size);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept
+{
+  try {
+    return operator new(size);
+  } catch(...) {
+    return nullptr;
+  }
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept
+{
+  return operator new(size, std::nothrow);
+}
+
+void operator delete(void *p) noexcept
+{
+  if (p == nullptr)
+    return;
 
-// Represents a record for a test
+  char *block = static_cast<char *>(p) - MTAllocations::header;
+  std::size_t size;
+  std::memcpy(&size, block, sizeof(size));
+  MTAllocations::frees++;
+  MTAllocations::freedBytes += size;
+  std::free(block);
+}
+
+void operator delete[](void *p) noexcept
+{
+  operator delete(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept
+{
+  operator delete(p);
+}
+
+void operator delete[](void *p, std::size_t) noexcept
+{
+  operator delete(p);
+}
+
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic pop
+#endif
+#endif
+
+// Where an assertion was made. As the default argument of an assertion,
+// current() is the file and line of its caller. The file is a string literal
+// of the program, so it is never copied.
+struct MTLocation
+{
+  const char *file = nullptr;
+  std::uint32_t line = 0;
+
+#if defined(__cpp_lib_source_location)
+  static MTLocation current(std::source_location where = std::source_location::current())
+  {
+    return {where.file_name(), where.line()};
+  }
+#elif defined(__GNUC__)
+  static MTLocation current(const char *file = __builtin_FILE(),
+                            std::uint32_t line = __builtin_LINE())
+  {
+    return {file, line};
+  }
+#else
+  static MTLocation current()
+  {
+    return {};
+  }
+#endif
+};
+
+// Represents a record for a test. The reason is plain text kept in the string
+// arena of the record store holding it; reporters add their own formatting.
+// The line of the location fills the padding after the flags, which keeps a
+// record at 32 bytes.
 using MTRecord = struct Record
 {
   bool pass;
   bool printable;
-  std::optional<std::string> reason;
+  std::uint32_t line;
+  std::string_view reason;
+  const char *file;
+
+  MTLocation where() const
+  {
+    return {file, line};
+  }
+
   friend std::ostream &operator<<(std::ostream &os, const struct Record &rec);
 };
 
 using MTRecords = std::vector<Record>;
 
-std::ostream &operator<<(std::ostream &os, const struct Record &rec)
+// Append-only storage for record reasons. Strings are copied into large blocks
+// that never move, so the views handed out stay valid until clear().
+class MTStringArena
 {
-  std::stringstream ss;
-  if (!rec.pass && rec.printable)
+public:
+  std::string_view intern(std::string_view str)
   {
-    ss << "  \u001b[31m[TEST CASE FAILED]" << std::endl
-       << "    Reason: " << rec.reason.value_or("no provided")
-       << "\033[0m";
-  }
+    if (str.empty())
+      return {};
 
-  os << ss.str();
-  return os;
-}
+    if (str.size() > _capacity - _used)
+    {
+      _capacity = std::max(_blockSize, str.size());
+      _blocks.emplace_back(new char[_capacity]);
+      _used = 0;
+    }
 
-// Class Forwarding
-class MTEnv;
+    char *data = _blocks.back().get() + _used;
+    std::memcpy(data, str.data(), str.size());
+    _used += str.size();
+    return std::string_view(data, str.size());
+  }
 
-//
-using MTFunction = std::function<void(MTEnv &env)>;
+  void clear()
+  {
+    _blocks.clear();
+    _used = _capacity = 0;
+  }
 
-// Represents a test
-using MTTest = struct MTTest
-{
-  int id;
-  std::string name;
-  std::string feedback;
-  MTFunction f;
+private:
+  static constexpr std::size_t _blockSize = 64 * 1024;
+  std::vector<std::unique_ptr<char[]>> _blocks;
+  std::size_t _used = 0;
+  std::size_t _capacity = 0;
 };
 
-class MTEnv
+// The records of every test in a single contiguous array. Test ids are dense,
+// so each test owns the range [begin, end) of the array found at its id.
+// Only the records that say something are kept: passes without a reason are
+// just counted, as are the failures of a test past the first few when a limit
+// is set, so memory grows with the failures rather than the assertions.
+class MTRecordStore
 {
 public:
-  MTEnv(bool showComp = false) : _currentTest(nullptr)
+  // A read-only view over the kept records of one test, with the number of
+  // assertions that passed and failed, kept or not
+  struct View
+  {
+    const Record *first;
+    const Record *last;
+    std::size_t passed = 0;
+    std::size_t failed = 0;
+
+    const Record *begin() const { return first; }
+    const Record *end() const { return last; }
+    // The number of assertions made
+    std::size_t size() const { return passed + failed; }
+    bool empty() const { return size() == 0; }
+    std::size_t kept() const { return last - first; }
+
+    // The failures only counted, past the limit of keep_failures
+    std::size_t dropped_failures() const
+    {
+      std::size_t keptFailures = 0;
+      for (const Record *rec = first; rec != last; rec++)
+      {
+        keptFailures += !rec->pass;
+      }
+      return failed - keptFailures;
+    }
+  };
+
+  // Keeps at most n failed records per test. The default keeps them all.
+  void keep_failures(std::size_t n)
   {
+    _keptFailures = n;
   }
 
-  ~MTEnv() = default;
+  // Appends a record to the range of the given test, copying the reason into
+  // the arena when there is one.
+  void append(std::size_t test, bool pass, bool printable,
+              std::string_view reason = {}, MTLocation where = {})
+  {
+    if (test >= _ranges.size())
+      _ranges.resize(test + 1);
 
-  // Non-copyable and non-movable
-  MTEnv(MTEnv &) = delete;
-  MTEnv(MTEnv &&) = delete;
-  MTEnv &operator=(MTEnv &) = delete;
-  MTEnv &&operator=(MTEnv &&) = delete;
+    // Passes without a reason and failures past the limit are only counted
+    _Range &range = _ranges[test];
+    if (pass)
+    {
+      range.passed++;
+      if (reason.empty())
+        return;
+    }
+    else if (++range.failed > _keptFailures)
+    {
+      return;
+    }
 
-  // Adds a test to the environment. A test is a tuple containing:
-  // (name, feedback, function)
-  void add_test(std::tuple<std::string, std::string, MTFunction> t)
+    if (range.begin == range.end)
+    {
+      range.begin = range.end = _records.size();
+    }
+    else if (range.end != _records.size())
+    {
+      // Another test appended in between, so move this range to the back to
+      // keep it contiguous.
+      std::size_t begin = _records.size();
+      _records.reserve(begin + (range.end - range.begin) + 1);
+      for (std::size_t i = range.begin; i < range.end; i++)
+      {
+        _records.push_back(_records[i]);
+      }
+      range.begin = begin;
+      range.end = _records.size();
+    }
+
+    if (!reason.empty())
+      reason = _strings.intern(reason);
+    _records.push_back(Record{pass, printable, where.line, reason, where.file});
+    range.end++;
+  }
+
+  // Appends the records of otherTest in another store to the given test
+  void append(std::size_t test, const MTRecordStore &other, std::size_t otherTest)
   {
-    auto [name, feedback, func] = t;
-    _tests.push_back(MTTest{MTEnv::_idCounter, name, feedback, func});
-    MTEnv::_idCounter++;
+    append(test, other.records(otherTest));
   }
 
-  // Same as above but takes a list of tuples in the following form:
-  // { (name, feedback, function)* }
-  void add_test(
-      const std::initializer_list<std::tuple<std::string, std::string, MTFunction>> &tests)
+  // Appends a view of records, with the assertions it only counted
+  void append(std::size_t test, View records)
   {
-    for (const auto &test : tests)
+    std::size_t passed = 0, failed = 0;
+    for (const auto &rec : records)
     {
-      add_test(test);
+      append(test, rec.pass, rec.printable, rec.reason, rec.where());
+      (rec.pass ? passed : failed)++;
     }
+    count(test, records.passed - passed, records.failed - failed);
   }
 
-  // Run all the test in the environment
-  void run_all(bool report = true, bool verbose = false)
+  // Counts assertions of a test without keeping a record of them
+  void count(std::size_t test, std::size_t passed, std::size_t failed)
   {
-    std::for_each(
-        _tests.begin(),
-        _tests.end(),
-        [this](MTTest &it) {
-          _currentTest.release();
-          _currentTest = std::make_unique<MTTest>(it);
-          // Each function needs the environment, thus *this
-          it.f(*this);
-        });
+    if (test >= _ranges.size())
+      _ranges.resize(test + 1);
+    _ranges[test].passed += passed;
+    _ranges[test].failed += failed;
+  }
 
-    if (report)
-      _report(verbose);
+  View records(std::size_t test) const
+  {
+    if (test >= _ranges.size())
+      return View{nullptr, nullptr};
+
+    const Record *data = _records.data();
+    const _Range &range = _ranges[test];
+    return View{data + range.begin, data + range.end, range.passed, range.failed};
   }
 
-  template <typename... Types,
-            typename Comp = std::function<bool(const Types &...)>>
-  void expect(Types... args, std::string reason, Comp c, bool printable)
+  void clear()
   {
-    Record rec;
-    rec.printable = printable;
-    if (c(args...) == true)
+    _records.clear();
+    _ranges.clear();
+    _strings.clear();
+  }
+
+private:
+  struct _Range
+  {
+    std::size_t begin = 0;
+    std::size_t end = 0;
+    std::size_t passed = 0;
+    std::size_t failed = 0;
+  };
+
+  std::vector<Record> _records;
+  std::vector<_Range> _ranges;
+  MTStringArena _strings;
+  std::size_t _keptFailures = std::numeric_limits<std::size_t>::max();
+};
+
+inline std::ostream &operator<<(std::ostream &os, const struct Record &rec)
+{
+  std::stringstream ss;
+  if (!rec.pass && rec.printable)
+  {
+    ss << "  \u001b[31m[TEST CASE FAILED]" << std::endl
+       << "    Reason: ";
+    if (rec.reason.empty())
+      ss << "no provided";
+    else
+      ss << "\u001b[31m" << rec.reason << "\033[0m" << std::endl;
+    ss << "\033[0m";
+  }
+
+  os << ss.str();
+  return os;
+}
+
+// Class Forwarding
+class MTEnv;
+
+//
+using MTFunction = std::function<void(MTEnv &env)>;
+
+// A test body that needs no state, called directly instead of through
+// std::function
+using MTPlainFunction = void (*)(MTEnv &env);
+
+#ifdef MT_HAS_COROUTINES
+// The result of a coroutine test body, or of a coroutine it awaits. It starts
+// suspended; awaiting it runs it and resumes the awaiter once it returned.
+class MTTask
+{
+public:
+  struct promise_type
+  {
+    std::coroutine_handle<> continuation;
+    std::exception_ptr error;
+
+    MTTask get_return_object()
     {
-      rec.pass = true;
-      rec.reason = {};
+      return MTTask(std::coroutine_handle<promise_type>::from_promise(*this));
     }
-    else
+
+    std::suspend_always initial_suspend() noexcept
     {
-      rec.pass = false;
+      return {};
+    }
 
-      std::stringstream ss;
-      ss << "\u001b[31m" << reason << "\033[0m" << std::endl;
-      rec.reason = ss.str();
+    auto final_suspend() noexcept
+    {
+      struct Final
+      {
+        bool await_ready() noexcept
+        {
+          return false;
+        }
+
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept
+        {
+          std::coroutine_handle<> next = h.promise().continuation;
+          return next ? next : std::noop_coroutine();
+        }
+
+        void await_resume() noexcept
+        {
+        }
+      };
+      return Final{};
+    }
+
+    void return_void()
+    {
     }
-    _insertRecord(rec);
+
+    void unhandled_exception()
+    {
+      error = std::current_exception();
+    }
+  };
+
+  using Handle = std::coroutine_handle<promise_type>;
+
+  MTTask(MTTask &&other) noexcept : _handle(std::exchange(other._handle, {}))
+  {
   }
 
-  // Assert equality within the environment
-  template <typename T>
-  void expect_eq(const T &l, const T &r, bool printable = true)
+  MTTask &operator=(MTTask &&other) noexcept
   {
-    std::stringstream reason;
-    reason << l << " != " << r;
+    std::swap(_handle, other._handle);
+    return *this;
+  }
 
-    expect<T, T>(l, r, reason.str(),
-                 [](const T &l, const T &r) {
-                   return l == r;
-                 }, printable);
+  ~MTTask()
+  {
+    if (_handle)
+      _handle.destroy();
   }
 
-  template <typename T>
-  void expect_neq(const T &l, const T &r, bool printable = true)
+  Handle handle() const
   {
-    std::stringstream reason;
-    reason << l << " == " << r;
+    return _handle;
+  }
 
-    expect<T, T>(l, r, reason.str(),
-                 [](const T &l, const T &r) {
-                   return l != r;
-                 }, printable);
+  bool done() const
+  {
+    return !_handle || _handle.done();
   }
 
-  void expect_true(bool val, bool printable = true)
+  // What the body threw, if anything
+  std::exception_ptr error() const
   {
-    std::stringstream reason;
-    reason << "value is false";
+    return _handle ? _handle.promise().error : nullptr;
+  }
 
-    expect<bool>(val, reason.str(),
-                 [](bool val) {
-                   return val == true;
-                 }, printable);
+  bool await_ready() const noexcept
+  {
+    return done();
   }
 
-  void expect_false(bool val, bool printable = true)
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept
   {
-    std::stringstream reason;
-    reason << "value is true";
+    _handle.promise().continuation = awaiter;
+    return _handle;
+  }
 
-    expect<bool>(val, reason.str(),
-                 [](bool val) {
-                   return val == false;
-                 }, printable);
+  void await_resume() const
+  {
+    if (std::exception_ptr e = error())
+      std::rethrow_exception(e);
   }
 
-  /* Runs F and expect E, otherwise fails. */
-  template <typename E, typename F = std::function<void()>>
-  void expect_except(const F& f, bool printable = false)
+private:
+  explicit MTTask(Handle handle) : _handle(handle)
   {
-    bool passed = false;
+  }
 
-    std::stringstream reason;
-    reason << typeid(E).name() << " did not occur.";
+  Handle _handle;
+};
 
-    try {
-      f();
-    } catch(const E&) {
-      passed = true;
-    }
+// Runs coroutine tasks on the calling thread. A task suspends on sleep_for,
+// readable or writable and is resumed when its timer expires or its
+// descriptor is ready, so one thread can wait on many tests at once.
+class MTEventLoop
+{
+public:
+  using Clock = std::chrono::steady_clock;
+  // Resumes a coroutine of a task, e.g. after making its test current
+  using Resumer = std::function<void(std::coroutine_handle<>)>;
+
+  MTEventLoop() = default;
+  MTEventLoop(const MTEventLoop &) = delete;
+  MTEventLoop &operator=(const MTEventLoop &) = delete;
 
-    expect<bool>(passed, reason.str(),
-                 [](bool val) {
-                  return val == true;
-                 }, printable);
+  // Starts a task on the next step. Its coroutines are resumed through resume
+  // when set, and done is called once the task returned.
+  void spawn(MTTask task, Resumer resume = {}, std::function<void(MTTask &)> done = {})
+  {
+    std::size_t id = _nextTask++;
+    std::coroutine_handle<> handle = task.handle();
+    _tasks.emplace(id, _Task{std::move(task), std::move(resume), std::move(done)});
+    _ready.push_back(_Waiter{handle, id});
   }
 
-  /* Runs F and assert that at least one exception is thrown, otherwise fails. */
-  template<typename F = std::function<void()>>
-  void expect_any_except(const F& f, bool printable = false)
+  bool empty() const
   {
-    bool passed = false;
+    return _tasks.empty();
+  }
 
-    try {
-      f();
-    } catch(...) {
-      passed = true;
+  // Resumes what is ready, first waiting up to timeout if nothing is
+  void run_once(Clock::duration timeout)
+  {
+    if (_ready.empty())
+      _wait(timeout);
+
+    std::vector<_Waiter> ready;
+    ready.swap(_ready);
+    for (const auto &waiter : ready)
+    {
+      _resume(waiter);
     }
+  }
 
-    expect<bool>(passed, "No exception occured.",
-                 [](bool val) {
-                   return val == true;
-                 }, printable);
+  // Runs until every task returned
+  void run()
+  {
+    while (!empty())
+      run_once(Clock::duration::max());
   }
 
-  /* Runs F and assert that no expections are thrown, otherwise fails. */
-  template<typename F = std::function<void()>>
-  void expect_no_except(const F& f, bool printable = false)
+  // What sleep_for and sleep_until return
+  struct SleepAwaiter
   {
-    bool passed = true;
-    std::stringstream reason;
+    MTEventLoop *loop;
+    Clock::time_point deadline;
 
-    try {
-      f();
-    } catch(...) {
-      passed = false;
-      auto except = std::current_exception();
+    bool await_ready() const
+    {
+      return Clock::now() >= deadline;
+    }
 
-      reason << "Exception " << typeid(except).name() << " occured.";
+    void await_suspend(std::coroutine_handle<> h)
+    {
+      loop->_timers.emplace(deadline, _Waiter{h, loop->_current});
+    }
+
+    void await_resume() const
+    {
     }
+  };
 
-    expect<bool>(passed, reason.str(),
-                 [](bool val) {
-                   return val == true;
-                 }, printable);
+  SleepAwaiter sleep_for(Clock::duration duration)
+  {
+    return sleep_until(Clock::now() + duration);
   }
 
-private:
-  // Inserts a list of records in the record map if it doesn't exist, otherwise
-  // appends a the given record to the record lists associated with the current
-  // test.
-  void _insertRecord(const Record &rec)
+  SleepAwaiter sleep_until(Clock::time_point deadline)
+  {
+    return SleepAwaiter{this, deadline};
+  }
+
+#ifdef MT_HAS_FORK
+  // What readable and writable return. The result of co_await is false when
+  // the timeout passed before the descriptor was ready.
+  struct FdAwaiter
   {
-    auto record = _records.find(_currentTest->id);
+    MTEventLoop *loop;
+    pollfd fd;
+    Clock::time_point deadline;
+    bool ready = false;
 
-    if (record != _records.end())
+    bool await_ready() const
     {
-      record->second.push_back(rec);
+      return false;
     }
-    else
+
+    void await_suspend(std::coroutine_handle<> h)
     {
-      _records.emplace(_currentTest->id, MTRecords{rec});
+      loop->_fds.push_back(_FdWait{fd, _Waiter{h, loop->_current}, deadline, &ready});
     }
-  }
 
-  void _report(bool verbose)
-  {
-    float passedCounter = 0;
-    float testCounter = 0;
+    bool await_resume() const
+    {
+      return ready;
+    }
+  };
 
-    std::for_each(
-        _records.begin(),
-        _records.end(),
-        [&](const auto &pair) {
-          int failedRecord = 0;
-          testCounter++;
-
-          MTTest test = _tests.at(pair.first);
-          std::cout << "\u001b[32m[RUNNING " << test.name << "]\033[0m" << std::endl;
-          // For each record in the test
-          std::for_each(
-              std::begin(pair.second),
-              std::end(pair.second),
-              [&](const MTRecord &rec) {
-                if (rec.pass == false)
-                {
-                  failedRecord++;
-                }
-
-                std::cout << rec;
-              });
-
-          // If verbose is on and test passed, print
-          if (failedRecord == 0)
-          {
-            passedCounter++;
-            std::cout << "  \u001b[32m[PASSED]\033[0m" << std::endl;
-          } else {
-            std::cout << "  \u001b[31mFeedback: "
-                      << test.feedback
-                      << "\033[0m"
-                      << std::endl;
-          }
-        });
+  // Resumes once fd can be read without blocking
+  FdAwaiter readable(int fd, Clock::duration timeout = Clock::duration::max())
+  {
+    return FdAwaiter{this, pollfd{fd, POLLIN, 0}, _deadline(timeout)};
+  }
 
-    int percentage = std::ceil((passedCounter / testCounter) * 100);
-    std::cout << std::endl
-              << "\u001b[32m"
-              << percentage
-              << "% of test passed\033[0m"
-              << std::endl;
+  // Resumes once fd can be written without blocking
+  FdAwaiter writable(int fd, Clock::duration timeout = Clock::duration::max())
+  {
+    return FdAwaiter{this, pollfd{fd, POLLOUT, 0}, _deadline(timeout)};
   }
+#endif
 
 private:
-  static int _idCounter;
-  std::unique_ptr<MTTest> _currentTest;
-  std::vector<MTTest> _tests;
-  std::map<int, MTRecords> _records;
-};
+  struct _Task
+  {
+    MTTask task;
+    Resumer resume;
+    std::function<void(MTTask &)> done;
+  };
 
-int MTEnv::_idCounter = 0;
+  // A suspended coroutine and the task it belongs to
+  struct _Waiter
+  {
+    std::coroutine_handle<> handle;
+    std::size_t task;
+  };
 
-// Generates a test to avoid boilerplate using the following semantics:
-// test_f("name" { ... })
+#ifdef MT_HAS_FORK
+  struct _FdWait
+  {
+    pollfd fd;
+    _Waiter waiter;
+    Clock::time_point deadline;
+    bool *ready;
+  };
+#endif
+
+  static Clock::time_point _deadline(Clock::duration timeout)
+  {
+    if (timeout == Clock::duration::max())
+      return Clock::time_point::max();
+    return Clock::now() + timeout;
+  }
+
+  // Waits, for at most timeout, until a timer expires or a descriptor is
+  // ready, and moves the coroutines waiting on them to _ready
+  void _wait(Clock::duration timeout)
+  {
+    Clock::time_point now = Clock::now();
+    Clock::time_point until = _deadline(timeout);
+    if (!_timers.empty())
+      until = std::min(until, _timers.begin()->first);
+
+#ifdef MT_HAS_FORK
+    std::vector<pollfd> fds;
+    for (const auto &wait : _fds)
+    {
+      fds.push_back(wait.fd);
+      until = std::min(until, wait.deadline);
+    }
+
+    int ms = -1;
+    if (until != Clock::time_point::max())
+    {
+      auto left = std::chrono::ceil<std::chrono::milliseconds>(until - now).count();
+      ms = int(std::clamp<decltype(left)>(left, 0, INT_MAX));
+    }
+    if (!fds.empty() || ms != -1)
+      poll(fds.data(), fds.size(), ms);
+    now = Clock::now();
+
+    std::vector<_FdWait> waiting;
+    for (std::size_t i = 0; i < _fds.size(); i++)
+    {
+      bool ready = fds[i].revents != 0;
+      if (ready || _fds[i].deadline <= now)
+      {
+        *_fds[i].ready = ready;
+        _ready.push_back(_fds[i].waiter);
+      }
+      else
+      {
+        waiting.push_back(_fds[i]);
+      }
+    }
+    _fds.swap(waiting);
+#else
+    if (until != Clock::time_point::max())
+      std::this_thread::sleep_until(until);
+    now = Clock::now();
+#endif
+
+    auto it = _timers.begin();
+    for (; it != _timers.end() && it->first <= now; it = _timers.erase(it))
+    {
+      _ready.push_back(it->second);
+    }
+  }
+
+  void _resume(const _Waiter &waiter)
+  {
+    auto it = _tasks.find(waiter.task);
+    _current = waiter.task;
+    if (it->second.resume)
+      it->second.resume(waiter.handle);
+    else
+      waiter.handle.resume();
+
+    if (!it->second.task.done())
+      return;
+    if (it->second.done)
+      it->second.done(it->second.task);
+    _tasks.erase(it);
+  }
+
+  std::map<std::size_t, _Task> _tasks;
+  std::size_t _nextTask = 0;
+  std::size_t _current = 0;
+  std::vector<_Waiter> _ready;
+  std::multimap<Clock::time_point, _Waiter> _timers;
+#ifdef MT_HAS_FORK
+  std::vector<_FdWait> _fds;
+#endif
+};
+
+// A coroutine test body
+using MTCoFunction = std::function<MTTask(MTEnv &env, MTEventLoop &loop)>;
+#endif
+
+// Represents a test. Only one of f, plain and co is set.
+using MTTest = struct MTTest
+{
+  int id;
+  std::string_view name;
+  std::string_view feedback;
+  MTFunction f;
+  MTPlainFunction plain = nullptr;
+#ifdef MT_HAS_COROUTINES
+  MTCoFunction co = {};
+#endif
+  // Scoring, see MTEnv::set_weight and MTEnv::set_category
+  double weight = 1;
+  bool partial = false;
+  std::string_view category = {};
+
+  // Runs the test to completion on the calling thread
+  void run(MTEnv &env) const
+  {
+#ifdef MT_HAS_COROUTINES
+    if (co)
+    {
+      MTEventLoop loop;
+      std::exception_ptr error;
+      loop.spawn(co(env, loop), {}, [&error](MTTask &task) {
+        error = task.error();
+      });
+      loop.run();
+      if (error)
+        std::rethrow_exception(error);
+      return;
+    }
+#endif
+    if (plain != nullptr)
+      plain(env);
+    else
+      f(env);
+  }
+};
+
+// Per-thread execution state used by the parallel runner: the test being run
+// by this worker, the store its records are written to (under id 0) and
+// whether one of them failed.
+struct MTContext
+{
+  const MTEnv *env;
+  const MTTest *test;
+  MTRecordStore *records;
+  bool failed = false;
+};
+
+// Thrown by a failed assertion in fail-fast mode to end the test early. It
+// does not derive from std::exception so tests catching those let it through.
+struct MTAbortTest
+{
+};
+
+// Options for run_all_isolated. A limit of zero means unlimited.
+struct MTIsolation
+{
+  unsigned int nWorkers = 1;
+  std::chrono::milliseconds wallLimit{0};
+  std::chrono::seconds cpuLimit{0};
+};
+
+// Options for the benchmark assertions. Samples are taken after the warmup
+// runs until the median moves by less than tolerance between two rounds of
+// minSamples, or until maxSamples or maxTime is reached.
+struct MTBenchmarkOptions
+{
+  std::size_t warmup = 3;
+  std::size_t minSamples = 10;
+  std::size_t maxSamples = 1000;
+  double tolerance = 0.02;
+  std::chrono::milliseconds maxTime{2000};
+};
+
+// Floating-point comparisons behind the tolerance assertions. near and
+// rel_near are constexpr; ulps is too where std::bit_cast is available.
+// NaN is never near anything.
+struct MTFloat
+{
+  template <typename T>
+  static constexpr T abs(T x)
+  {
+    return x < 0 ? -x : x;
+  }
+
+  // |a - b| <= eps
+  template <typename T>
+  static constexpr bool near(T a, T b, T eps)
+  {
+    return abs(a - b) <= eps;
+  }
+
+  // |a - b| <= rel * max(|a|, |b|)
+  template <typename T>
+  static constexpr bool rel_near(T a, T b, T rel)
+  {
+    T scale = abs(a) > abs(b) ? abs(a) : abs(b);
+    return abs(a - b) <= rel * scale;
+  }
+
+  // The number of representable values between a and b, with -0 and +0
+  // counting as the same value
+  template <typename T>
+  static MT_BIT_CAST_CONSTEXPR std::uint64_t ulp_distance(T a, T b)
+  {
+    std::uint64_t x = _ordered(a), y = _ordered(b);
+    return x > y ? x - y : y - x;
+  }
+
+  template <typename T>
+  static MT_BIT_CAST_CONSTEXPR bool ulps(T a, T b, std::uint64_t n)
+  {
+    if (a != a || b != b)
+      return false;
+    return ulp_distance(a, b) <= n;
+  }
+
+private:
+  // Maps the bits of a float onto integers that have the order of the values
+  template <typename T>
+  static MT_BIT_CAST_CONSTEXPR std::uint64_t _ordered(T x)
+  {
+    static_assert(std::is_same_v<T, float> || std::is_same_v<T, double>,
+                  "ulps comparisons work on float and double");
+    using Bits = std::conditional_t<sizeof(T) == 4, std::int32_t, std::int64_t>;
+
+#if defined(__cpp_lib_bit_cast)
+    Bits bits = std::bit_cast<Bits>(x);
+#else
+    Bits bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+#endif
+    std::int64_t value = bits < 0 ? std::numeric_limits<Bits>::min() - bits : bits;
+    return std::uint64_t(value) + (std::uint64_t(1) << 63);
+  }
+};
+
+// The result of measuring a callable
+struct MTTiming
+{
+  std::chrono::nanoseconds median;
+  std::chrono::nanoseconds p95;
+  std::size_t samples;
+};
+
+// A small seeded generator (splitmix64) for property tests. Unlike the
+// standard distributions it gives the same values on every platform, so a
+// failing seed reproduces anywhere.
+class MTRandom
+{
+public:
+  static constexpr std::uint64_t defaultSeed = 0x6d7465737453eedULL;
+
+  explicit MTRandom(std::uint64_t seed = defaultSeed) : _state(seed)
+  {
+  }
+
+  // The seed of the n-th stream derived from seed
+  static constexpr std::uint64_t mix(std::uint64_t seed, std::uint64_t n)
+  {
+    std::uint64_t z = seed + (n + 1) * 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+  }
+
+  std::uint64_t next()
+  {
+    _state += 0x9e3779b97f4a7c15ULL;
+    return mix(_state, std::uint64_t(-1));
+  }
+
+  // Uniform in [0, n), n > 0
+  std::uint64_t below(std::uint64_t n)
+  {
+    std::uint64_t limit = std::numeric_limits<std::uint64_t>::max() -
+                          std::numeric_limits<std::uint64_t>::max() % n;
+    std::uint64_t x;
+    do
+    {
+      x = next();
+    } while (x >= limit);
+    return x % n;
+  }
+
+  // Uniform in [lo, hi]
+  template <typename T>
+  T uniform(T lo, T hi)
+  {
+    if constexpr (std::is_floating_point_v<T>)
+    {
+      double unit = double(next() >> 11) * 0x1.0p-53;
+      return T(lo + (hi - lo) * unit);
+    }
+    else
+    {
+      std::uint64_t span = std::uint64_t(hi) - std::uint64_t(lo);
+      std::uint64_t x = span == std::numeric_limits<std::uint64_t>::max()
+                            ? next()
+                            : below(span + 1);
+      return T(std::uint64_t(lo) + x);
+    }
+  }
+
+private:
+  std::uint64_t _state;
+};
+
+// True for the types that can be written to a std::ostream
+template <typename T, typename = void>
+struct MTStreamable : std::false_type
+{
+};
+
+template <typename T>
+struct MTStreamable<T, std::void_t<decltype(std::declval<std::ostream &>() << std::declval<const T &>())>>
+    : std::true_type
+{
+};
+
+// Writes a generated value for a report: streamable types as themselves,
+// enums as their value, vectors element by element, anything else as a
+// placeholder
+template <typename T>
+void mt_describe(std::ostream &os, const T &value)
+{
+  if constexpr (MTStreamable<T>::value)
+  {
+    os << value;
+  }
+  else if constexpr (std::is_enum_v<T>)
+  {
+    os << +static_cast<std::underlying_type_t<T>>(value);
+  }
+  else
+  {
+    os << "(not printable)";
+  }
+}
+
+template <typename T>
+void mt_describe(std::ostream &os, const std::vector<T> &values)
+{
+  os << "[";
+  for (std::size_t i = 0; i < values.size(); i++)
+  {
+    if (i != 0)
+      os << ", ";
+    mt_describe(os, values[i]);
+  }
+  os << "]";
+}
+
+// For static_assert in templates that must not be instantiated
+template <typename T>
+inline constexpr bool mt_always_false = false;
+
+#define MT_LOGICAL_IN_CHECK \
+  "MT_CHECK cannot decompose && or ||, wrap the condition in parentheses: " \
+  "MT_CHECK((a == 1 && b == 2))"
+
+// A comparison captured by MT_CHECK: both operands by reference, the
+// operator and its result. Nothing is formatted unless describe is called.
+template <typename L, typename R>
+struct MTBinaryExpr
+{
+  const L &lhs;
+  const R &rhs;
+  const char *op;
+  bool result;
+
+  bool passed() const
+  {
+    return result;
+  }
+
+  void describe(std::ostream &os) const
+  {
+    mt_describe(os, lhs);
+    os << ' ' << op << ' ';
+    mt_describe(os, rhs);
+  }
+
+  // && and || would lose their short-circuit if both sides were captured
+  template <typename T>
+  bool operator&&(const T &) const
+  {
+    static_assert(mt_always_false<T>, MT_LOGICAL_IN_CHECK);
+    return false;
+  }
+
+  template <typename T>
+  bool operator||(const T &) const
+  {
+    static_assert(mt_always_false<T>, MT_LOGICAL_IN_CHECK);
+    return false;
+  }
+};
+
+// The left operand of MT_CHECK. Comparing it captures the right operand, and
+// on its own it is checked for truth. MT_CHECK(v.size() == 3) is the usual
+// check, so mixed signs must not warn from inside the header.
+#if defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wsign-compare"
+#endif
+template <typename L>
+struct MTUnaryExpr
+{
+  const L &value;
+
+  bool passed() const
+  {
+    return static_cast<bool>(value);
+  }
+
+  void describe(std::ostream &os) const
+  {
+    mt_describe(os, value);
+  }
+
+  template <typename R>
+  MTBinaryExpr<L, R> operator==(const R &rhs) const
+  {
+    return {value, rhs, "==", static_cast<bool>(value == rhs)};
+  }
+
+  template <typename R>
+  MTBinaryExpr<L, R> operator!=(const R &rhs) const
+  {
+    return {value, rhs, "!=", static_cast<bool>(value != rhs)};
+  }
+
+  template <typename R>
+  MTBinaryExpr<L, R> operator<(const R &rhs) const
+  {
+    return {value, rhs, "<", static_cast<bool>(value < rhs)};
+  }
+
+  template <typename R>
+  MTBinaryExpr<L, R> operator<=(const R &rhs) const
+  {
+    return {value, rhs, "<=", static_cast<bool>(value <= rhs)};
+  }
+
+  template <typename R>
+  MTBinaryExpr<L, R> operator>(const R &rhs) const
+  {
+    return {value, rhs, ">", static_cast<bool>(value > rhs)};
+  }
+
+  template <typename R>
+  MTBinaryExpr<L, R> operator>=(const R &rhs) const
+  {
+    return {value, rhs, ">=", static_cast<bool>(value >= rhs)};
+  }
+
+  // Same as MTBinaryExpr
+  template <typename T>
+  bool operator&&(const T &) const
+  {
+    static_assert(mt_always_false<T>, MT_LOGICAL_IN_CHECK);
+    return false;
+  }
+
+  template <typename T>
+  bool operator||(const T &) const
+  {
+    static_assert(mt_always_false<T>, MT_LOGICAL_IN_CHECK);
+    return false;
+  }
+};
+#if defined(__GNUC__)
+#pragma GCC diagnostic pop
+#endif
+
+// Starts the decomposition of an MT_CHECK expression. <= binds tighter than
+// the comparisons and looser than arithmetic, so MTDecomposer{} <= a + 1 == b
+// captures a + 1 and then b.
+struct MTDecomposer
+{
+  template <typename L>
+  MTUnaryExpr<L> operator<=(const L &lhs) const
+  {
+    return {lhs};
+  }
+};
+
+// Makes random values of T for property tests. shrink lists simpler
+// candidates for a value, the simplest first; a failing input is shrunk by
+// moving to the first candidate that still fails until none does.
+template <typename T>
+struct MTGen
+{
+  std::function<T(MTRandom &)> generate;
+  std::function<std::vector<T>(const T &)> shrink = [](const T &) {
+    return std::vector<T>{};
+  };
+
+  // n values from a fixed seed, e.g. as the parameters of a test_p
+  std::vector<T> sample(std::size_t n, std::uint64_t seed = MTRandom::defaultSeed) const
+  {
+    MTRandom random(seed);
+    std::vector<T> values;
+    values.reserve(n);
+    for (std::size_t i = 0; i < n; i++)
+    {
+      values.push_back(generate(random));
+    }
+    return values;
+  }
+};
+
+// Common generators
+struct MTGenerate
+{
+  // Integers in [lo, hi], shrinking towards the one closest to zero
+  template <typename T>
+  static MTGen<T> integers(T lo, T hi)
+  {
+    static_assert(std::is_integral_v<T>, "integers needs an integral type");
+    T target = lo > 0 ? lo : (hi < 0 ? hi : T(0));
+    MTGen<T> gen;
+    gen.generate = [lo, hi](MTRandom &random) {
+      return random.uniform(lo, hi);
+    };
+    gen.shrink = [target](const T &value) {
+      std::vector<T> candidates;
+      for (T diff = T(value - target); diff != 0; diff = T(diff / 2))
+      {
+        candidates.push_back(T(value - diff));
+      }
+      return candidates;
+    };
+    return gen;
+  }
+
+  // Floating-point values in [lo, hi], shrinking towards the one closest to
+  // zero and towards whole numbers
+  template <typename T>
+  static MTGen<T> reals(T lo, T hi)
+  {
+    static_assert(std::is_floating_point_v<T>, "reals needs a floating-point type");
+    T target = lo > 0 ? lo : (hi < 0 ? hi : T(0));
+    MTGen<T> gen;
+    gen.generate = [lo, hi](MTRandom &random) {
+      return random.uniform(lo, hi);
+    };
+    gen.shrink = [lo, hi, target](const T &value) {
+      std::vector<T> candidates;
+      if (value == target)
+        return candidates;
+
+      candidates.push_back(target);
+      T whole = std::trunc(value);
+      if (whole != value && whole >= lo && whole <= hi)
+        candidates.push_back(whole);
+      T half = target + (value - target) / 2;
+      if (half != value && half != target)
+        candidates.push_back(half);
+      return candidates;
+    };
+    return gen;
+  }
+
+  // One of the given values, shrinking towards the first ones
+  template <typename T>
+  static MTGen<T> element_of(std::vector<T> values)
+  {
+    auto shared = std::make_shared<const std::vector<T>>(std::move(values));
+    MTGen<T> gen;
+    gen.generate = [shared](MTRandom &random) {
+      return (*shared)[random.below(shared->size())];
+    };
+    gen.shrink = [shared](const T &value) {
+      std::vector<T> candidates;
+      for (const T &candidate : *shared)
+      {
+        if (candidate == value)
+          break;
+        candidates.push_back(candidate);
+      }
+      return candidates;
+    };
+    return gen;
+  }
+
+  // Vectors of minSize to maxSize elements. They shrink by dropping halves,
+  // then single elements, then by shrinking their elements.
+  template <typename T>
+  static MTGen<std::vector<T>> vectors(MTGen<T> element, std::size_t minSize,
+                                       std::size_t maxSize)
+  {
+    MTGen<std::vector<T>> gen;
+    gen.generate = [element, minSize, maxSize](MTRandom &random) {
+      std::size_t size = random.uniform(minSize, maxSize);
+      std::vector<T> values;
+      values.reserve(size);
+      for (std::size_t i = 0; i < size; i++)
+      {
+        values.push_back(element.generate(random));
+      }
+      return values;
+    };
+    gen.shrink = [element, minSize](const std::vector<T> &values) {
+      std::vector<std::vector<T>> candidates;
+      std::size_t half = values.size() / 2;
+      if (half != 0 && values.size() - half >= minSize)
+      {
+        candidates.emplace_back(values.begin() + half, values.end());
+        candidates.emplace_back(values.begin(), values.end() - half);
+      }
+      if (values.size() > minSize)
+      {
+        for (std::size_t i = 0; i < values.size(); i++)
+        {
+          candidates.push_back(values);
+          candidates.back().erase(candidates.back().begin() + i);
+        }
+      }
+      for (std::size_t i = 0; i < values.size(); i++)
+      {
+        for (T &simpler : element.shrink(values[i]))
+        {
+          candidates.push_back(values);
+          candidates.back()[i] = std::move(simpler);
+        }
+      }
+      return candidates;
+    };
+    return gen;
+  }
+};
+
+// Options for add_property. Without a seed the environment's is used, see
+// set_seed. The cases are split into batches of batchSize, each registered as
+// its own test so the parallel runner can spread them.
+struct MTPropertyOptions
+{
+  std::size_t cases = 100;
+  std::size_t batchSize = 25;
+  std::size_t maxShrinks = 1000;
+  std::optional<std::uint64_t> seed;
+};
+
+// A double-ended queue of test indices owned by one worker. The owner takes
+// work from the front, idle workers steal from the back.
+class MTWorkQueue
+{
+public:
+  void push(std::size_t index)
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _indices.push_back(index);
+  }
+
+  std::optional<std::size_t> pop()
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_indices.empty())
+      return {};
+
+    std::size_t index = _indices.front();
+    _indices.pop_front();
+    return index;
+  }
+
+  std::optional<std::size_t> steal()
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_indices.empty())
+      return {};
+
+    std::size_t index = _indices.back();
+    _indices.pop_back();
+    return index;
+  }
+
+private:
+  std::mutex _mutex;
+  std::deque<std::size_t> _indices;
+};
+
+// The weighted score of a run, or of one rubric category of it. A passing
+// test earns its weight, a failing one nothing, unless it gets partial credit
+// for the share of its assertions that passed.
+struct MTScore
+{
+  double earned = 0;
+  double possible = 0;
+  // Tests that made no assertion
+  std::size_t empty = 0;
+
+  MTScore &operator+=(const MTScore &other)
+  {
+    earned += other.earned;
+    possible += other.possible;
+    empty += other.empty;
+    return *this;
+  }
+
+  double percentage() const
+  {
+    return possible == 0 ? 0 : earned / possible * 100;
+  }
+};
+
+// The totals of a run. A sharded run is combined by adding up the summaries
+// of its shards, e.g. the summary lines written by MTJsonLinesReporter.
+struct MTSummary
+{
+  std::size_t passed = 0;
+  std::size_t total = 0;
+  MTScore score = {};
+
+  MTSummary &operator+=(const MTSummary &other)
+  {
+    passed += other.passed;
+    total += other.total;
+    score += other.score;
+    return *this;
+  }
+
+  int percentage() const
+  {
+    return total == 0 ? 0 : std::ceil((float(passed) / total) * 100);
+  }
+
+  // Reads a {"summary":{"passed":N,"total":M,...}} line. Lines without a
+  // score give every test a weight of one.
+  static std::optional<MTSummary> parse(std::string_view line)
+  {
+    if (line.find("\"summary\"") == std::string_view::npos)
+      return {};
+
+    auto field = [line](std::string_view key) -> std::optional<double> {
+      std::size_t at = line.find(key);
+      if (at == std::string_view::npos)
+        return {};
+      return std::strtod(line.data() + at + key.size(), nullptr);
+    };
+
+    auto passed = field("\"passed\":");
+    auto total = field("\"total\":");
+    if (!passed || !total)
+      return {};
+    MTSummary summary{std::size_t(*passed), std::size_t(*total)};
+    summary.score.earned = field("\"earned\":").value_or(*passed);
+    summary.score.possible = field("\"possible\":").value_or(*total);
+    summary.score.empty = field("\"empty\":").value_or(0);
+    return summary;
+  }
+
+  // Adds up every summary line found in a stream
+  static MTSummary read(std::istream &is)
+  {
+    MTSummary summary;
+    std::string line;
+    while (std::getline(is, line))
+    {
+      if (auto partial = parse(line))
+        summary += *partial;
+    }
+    return summary;
+  }
+};
+
+// An opt-in timeline of a run in the Chrome trace event format, which
+// chrome://tracing and Perfetto open. Each test is a span on the thread that
+// ran it. One assertion in every `sampling` is a span too, covering the time
+// since the assertion before it, so the hot ones stand out; the others only
+// count down, which keeps tracing cheap on large suites.
+class MTTrace
+{
+public:
+  using Clock = std::chrono::steady_clock;
+
+  explicit MTTrace(std::size_t sampling = 1000)
+      : _sampling(std::max<std::size_t>(1, sampling)), _origin(Clock::now())
+  {
+  }
+
+  // Called when the calling thread starts a test
+  void begin_test()
+  {
+    _armed = Clock::now();
+  }
+
+  // A test that started at begin and ran for wall, on the calling thread
+  // unless another track is given
+  void test(std::string_view name, Clock::time_point begin, Clock::duration wall,
+            int track = -1)
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _events.push_back(_Event{name, {}, true, track < 0 ? _track() : track, begin, wall});
+  }
+
+  void assertion(const MTLocation &where, bool pass)
+  {
+    if (_left > 1)
+    {
+      _left--;
+      return;
+    }
+
+    Clock::time_point now = Clock::now();
+    if (_left == 1)
+    {
+      // The assertion before a sampled one starts its span
+      _left = 0;
+      _armed = now;
+      return;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _events.push_back(_Event{{}, where, pass, _track(), _armed, now - _armed});
+    }
+    _armed = now;
+    _left = _sampling - 1;
+  }
+
+  void write(std::ostream &os) const
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    os << "{\"traceEvents\":[";
+    for (std::size_t i = 0; i < _events.size(); i++)
+    {
+      const _Event &event = _events[i];
+      os << (i == 0 ? "\n" : ",\n") << "{\"name\":\"";
+      if (event.where.file != nullptr)
+      {
+        _escape(os, event.where.file);
+        os << ':' << event.where.line;
+      }
+      else if (event.name.empty())
+      {
+        os << "assertion";
+      }
+      else
+      {
+        _escape(os, event.name);
+      }
+      os << "\",\"cat\":\"" << (event.name.empty() ? "assertion" : "test")
+         << "\",\"ph\":\"X\",\"ts\":" << _micros(event.begin - _origin)
+         << ",\"dur\":" << _micros(event.wall) << ",\"pid\":1,\"tid\":" << event.track;
+      if (event.name.empty())
+        os << ",\"args\":{\"pass\":" << (event.pass ? "true" : "false") << '}';
+      os << '}';
+    }
+    os << "\n]}\n";
+  }
+
+private:
+  struct _Event
+  {
+    // Empty for an assertion
+    std::string_view name;
+    MTLocation where;
+    bool pass;
+    int track;
+    Clock::time_point begin;
+    Clock::duration wall;
+  };
+
+  static double _micros(Clock::duration d)
+  {
+    return std::chrono::duration<double, std::micro>(d).count();
+  }
+
+  static void _escape(std::ostream &os, std::string_view str)
+  {
+    for (char c : str)
+    {
+      if (c == '"' || c == '\\')
+        os << '\\' << c;
+      else if (static_cast<unsigned char>(c) >= 0x20)
+        os << c;
+    }
+  }
+
+  // One track per thread, numbered in the order threads first trace
+  static int _track()
+  {
+    static std::atomic<int> tracks{0};
+    if (_thread < 0)
+      _thread = tracks++;
+    return _thread;
+  }
+
+  static inline thread_local int _thread = -1;
+  static inline thread_local std::size_t _left = 0;
+  static inline thread_local Clock::time_point _armed;
+
+  std::size_t _sampling;
+  Clock::time_point _origin;
+  mutable std::mutex _mutex;
+  std::vector<_Event> _events;
+};
+
+// A read-only view of a whole file, memory-mapped where the platform allows
+// it and read into memory otherwise
+class MTMappedFile
+{
+public:
+  explicit MTMappedFile(const std::string &path) : _path(path)
+  {
+#ifdef MT_HAS_FORK
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      throw std::runtime_error("mtest: unable to open " + path);
+
+    struct stat info;
+    if (fstat(fd, &info) != 0)
+    {
+      close(fd);
+      throw std::runtime_error("mtest: unable to stat " + path);
+    }
+
+    _size = info.st_size;
+    if (_size > 0)
+    {
+      void *data = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data == MAP_FAILED)
+      {
+        close(fd);
+        throw std::runtime_error("mtest: unable to map " + path);
+      }
+      // Golden files are read front to back
+      madvise(data, _size, MADV_SEQUENTIAL);
+      _data = static_cast<const char *>(data);
+      _mapped = true;
+    }
+    close(fd);
+#else
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+      throw std::runtime_error("mtest: unable to open " + path);
+
+    _fallback.assign(std::istreambuf_iterator<char>(in), {});
+    _data = _fallback.data();
+    _size = _fallback.size();
+#endif
+  }
+
+  ~MTMappedFile()
+  {
+#ifdef MT_HAS_FORK
+    if (_mapped)
+      munmap(const_cast<char *>(_data), _size);
+#endif
+  }
+
+  MTMappedFile(const MTMappedFile &) = delete;
+  MTMappedFile &operator=(const MTMappedFile &) = delete;
+
+  MTMappedFile(MTMappedFile &&other) noexcept
+      : _path(std::move(other._path)), _fallback(std::move(other._fallback)),
+        _data(other._mapped ? other._data : _fallback.data()),
+        _size(other._size), _mapped(other._mapped)
+  {
+    other._data = nullptr;
+    other._size = 0;
+    other._mapped = false;
+  }
+
+  std::string_view view() const
+  {
+    return std::string_view(_data, _size);
+  }
+
+  const std::string &path() const
+  {
+    return _path;
+  }
+
+private:
+  std::string _path;
+  std::string _fallback;
+  const char *_data = nullptr;
+  std::size_t _size = 0;
+  bool _mapped = false;
+};
+
+// Compares text received in chunks against an expected text and stops at the
+// first difference. Passing chunks cost one memcmp; the line and column of a
+// difference are only worked out when it is described.
+class MTTextMatcher
+{
+public:
+  explicit MTTextMatcher(std::string_view expected) : _expected(expected)
+  {
+  }
+
+  // Returns false once a difference has been found
+  bool feed(std::string_view chunk)
+  {
+    if (_failed)
+      return false;
+
+    std::size_t n = std::min(chunk.size(), _expected.size() - _offset);
+    const char *expected = _expected.data() + _offset;
+    if (n != 0 && std::memcmp(chunk.data(), expected, n) != 0)
+    {
+      std::size_t at = std::mismatch(chunk.data(), chunk.data() + n, expected).first -
+                       chunk.data();
+      return _fail(_offset + at, chunk.substr(at));
+    }
+
+    _offset += n;
+    if (chunk.size() > n)
+      return _fail(_offset, chunk.substr(n));
+    return true;
+  }
+
+  // Called once the whole output was fed; fails if it stopped early
+  bool finish()
+  {
+    if (!_failed && _offset < _expected.size())
+      _fail(_offset, {});
+    return !_failed;
+  }
+
+  bool matched() const
+  {
+    return !_failed;
+  }
+
+  void describe(std::ostream &os) const
+  {
+    std::string_view before = _expected.substr(0, _offset);
+    std::size_t line = 1 + std::count(before.begin(), before.end(), '\n');
+    std::size_t lineStart = before.rfind('\n');
+    std::size_t column = _offset - (lineStart == std::string_view::npos ? 0 : lineStart + 1) + 1;
+
+    os << "line " << line << ", column " << column << ": expected ";
+    _excerpt(os, _expected.substr(_offset), "<end of file>");
+    os << " but got ";
+    _excerpt(os, _got, "<end of output>");
+  }
+
+private:
+  bool _fail(std::size_t offset, std::string_view got)
+  {
+    _failed = true;
+    _offset = offset;
+    _got = std::string(got.substr(0, _excerptSize));
+    return false;
+  }
+
+  // Quotes the start of text, up to the end of its line
+  static void _excerpt(std::ostream &os, std::string_view text, const char *empty)
+  {
+    if (text.empty())
+    {
+      os << empty;
+      return;
+    }
+
+    std::size_t end = std::min(text.size(), _excerptSize);
+    std::size_t newline = text.find('\n', 1);
+    if (newline != std::string_view::npos && newline < end)
+      end = newline;
+
+    os << '"';
+    for (char c : text.substr(0, end))
+    {
+      switch (c)
+      {
+      case '\n': os << "\\n"; break;
+      case '\r': os << "\\r"; break;
+      case '\t': os << "\\t"; break;
+      default: os << c;
+      }
+    }
+    os << '"';
+  }
+
+  static constexpr std::size_t _excerptSize = 40;
+  std::string_view _expected;
+  std::size_t _offset = 0;
+  bool _failed = false;
+  std::string _got;
+};
+
+// Results of earlier runs kept in a file, keyed by test name, build id and
+// input hash. A cache written by another build is ignored as a whole, so a
+// rebuilt grader never replays stale results.
+class MTResultCache
+{
+public:
+  MTResultCache(std::string path, std::string buildId)
+      : _path(std::move(path)), _buildId(std::move(buildId))
+  {
+    _load();
+  }
+
+  // 64-bit FNV-1a, the same on every platform. Pass a previous hash as seed
+  // to hash several pieces as one.
+  static std::uint64_t hash(std::string_view data,
+                            std::uint64_t seed = 14695981039346656037ull)
+  {
+    std::uint64_t hash = seed;
+    for (char c : data)
+    {
+      hash ^= static_cast<unsigned char>(c);
+      hash *= 1099511628211ull;
+    }
+    return hash;
+  }
+
+  static std::uint64_t hash_file(const std::string &path,
+                                 std::uint64_t seed = 14695981039346656037ull)
+  {
+    MTMappedFile file(path);
+    return hash(file.view(), seed);
+  }
+
+  // Identifies the running binary: the hash of its contents where it can be
+  // read, the compilation time of this file otherwise
+  static std::string executable_id()
+  {
+#ifdef __linux__
+    try {
+      return std::to_string(hash_file("/proc/self/exe"));
+    } catch(const std::runtime_error &) {
+    }
+#endif
+    return __DATE__ " " __TIME__;
+  }
+
+  // The cached records of a test for this input, if any. Tests are known by
+  // id and name, since two tests may share a name.
+  std::optional<MTRecordStore::View> find(int id, std::string_view name,
+                                          std::uint64_t input) const
+  {
+    auto it = _entries.find(_Key{id, std::string(name)});
+    if (it == _entries.end() || it->second.input != input)
+      return {};
+    return _store.records(it->second.slot);
+  }
+
+  void store(int id, std::string_view name, std::uint64_t input,
+             MTRecordStore::View records)
+  {
+    // A new slot each time, so replacing a result never mixes two of them
+    _Entry entry{input, _slots++};
+    _store.append(entry.slot, records);
+    _entries[_Key{id, std::string(name)}] = entry;
+    _dirty = true;
+  }
+
+  // Writes the cache back if it changed. The new contents go to a temporary
+  // file renamed over the old one, so an interrupted run never leaves a
+  // partial cache behind.
+  void save()
+  {
+    if (!_dirty)
+      return;
+
+    std::string temporary = _path + ".tmp";
+    {
+      std::ofstream out(temporary, std::ios::binary);
+      out << "mtest-cache 3 ";
+      _writeString(out, _buildId);
+      out << '\n';
+      for (const auto &[key, entry] : _entries)
+      {
+        MTRecordStore::View records = _store.records(entry.slot);
+        out << key.first << ' ';
+        _writeString(out, key.second);
+        out << ' ' << entry.input << ' ' << records.kept() << ' ' << records.passed
+            << ' ' << records.failed << '\n';
+        for (const auto &rec : records)
+        {
+          out << rec.pass << rec.printable << ' ';
+          _writeString(out, rec.reason);
+          out << '\n';
+        }
+      }
+
+      if (!out)
+      {
+        std::remove(temporary.c_str());
+        return;
+      }
+    }
+    std::rename(temporary.c_str(), _path.c_str());
+    _dirty = false;
+  }
+
+private:
+  using _Key = std::pair<int, std::string>;
+
+  struct _Entry
+  {
+    std::uint64_t input;
+    std::size_t slot;
+  };
+
+  // Strings are written as <length>:<bytes> so they may hold anything
+  static void _writeString(std::ostream &os, std::string_view str)
+  {
+    os << str.size() << ':' << str;
+  }
+
+  static std::optional<std::string> _readString(std::istream &is)
+  {
+    std::size_t size;
+    if (!(is >> size) || is.get() != ':')
+      return {};
+
+    std::string str(size, '\0');
+    if (!is.read(&str[0], size))
+      return {};
+    return str;
+  }
+
+  // Reads what a previous save wrote. A missing, corrupt or foreign file
+  // leaves the cache empty, or with the entries read before the problem.
+  void _load()
+  {
+    std::ifstream in(_path, std::ios::binary);
+    std::string magic;
+    int version;
+    if (!(in >> magic >> version) || magic != "mtest-cache" || version != 3)
+      return;
+
+    std::optional<std::string> build = _readString(in);
+    if (!build || *build != _buildId)
+      return;
+
+    while (in >> std::ws && in.peek() != EOF)
+    {
+      int id;
+      if (!(in >> id >> std::ws))
+        return;
+      std::optional<std::string> name = _readString(in);
+      std::uint64_t input;
+      std::size_t count, passed, failed;
+      if (!name || !(in >> input >> count >> passed >> failed))
+        return;
+
+      _Entry entry{input, _slots++};
+      for (std::size_t i = 0; i < count; i++)
+      {
+        char pass, printable;
+        if (!(in >> pass) || !in.get(printable))
+          return;
+        std::optional<std::string> reason = _readString(in);
+        if (!reason)
+          return;
+        _store.append(entry.slot, pass == '1', printable == '1', *reason);
+        (pass == '1' ? passed : failed)--;
+      }
+      _store.count(entry.slot, passed, failed);
+      _entries[_Key{id, std::move(*name)}] = entry;
+    }
+  }
+
+  std::string _path;
+  std::string _buildId;
+  std::map<_Key, _Entry> _entries;
+  MTRecordStore _store;
+  std::size_t _slots = 0;
+  bool _dirty = false;
+};
+
+// A stream buffer that keeps everything written to it in one growable block
+class MTCaptureBuffer : public std::streambuf
+{
+public:
+  MTCaptureBuffer()
+  {
+    _grow(4096);
+  }
+
+  std::string_view view() const
+  {
+    return std::string_view(pbase(), pptr() - pbase());
+  }
+
+protected:
+  int_type overflow(int_type c) override
+  {
+    if (traits_type::eq_int_type(c, traits_type::eof()))
+      return traits_type::not_eof(c);
+
+    _grow(_buffer.size() * 2);
+    *pptr() = traits_type::to_char_type(c);
+    pbump(1);
+    return c;
+  }
+
+  std::streamsize xsputn(const char *s, std::streamsize n) override
+  {
+    if (epptr() - pptr() < n)
+      _grow(std::max<std::size_t>(_buffer.size() * 2, (pptr() - pbase()) + n));
+    std::memcpy(pptr(), s, n);
+    pbump(int(n));
+    return n;
+  }
+
+private:
+  void _grow(std::size_t size)
+  {
+    std::size_t used = pptr() - pbase();
+    _buffer.resize(size);
+    setp(_buffer.data(), _buffer.data() + _buffer.size());
+    pbump(int(used));
+  }
+
+  std::vector<char> _buffer;
+};
+
+// Captures what is written to a C++ stream, std::cout by default, from its
+// creation until stop() or its destruction. The stream is shared by the
+// whole process, so only capture it from tests that run one at a time.
+class MTStreamCapture
+{
+public:
+  explicit MTStreamCapture(std::ostream &os = std::cout)
+      : _os(&os), _previous(os.rdbuf(&_buffer))
+  {
+  }
+
+  ~MTStreamCapture()
+  {
+    stop();
+  }
+
+  MTStreamCapture(const MTStreamCapture &) = delete;
+  MTStreamCapture &operator=(const MTStreamCapture &) = delete;
+
+  void stop()
+  {
+    if (_os == nullptr)
+      return;
+
+    _os->rdbuf(_previous);
+    _os = nullptr;
+  }
+
+  // What was captured so far, valid until the capture is destroyed
+  std::string_view view() const
+  {
+    return _buffer.view();
+  }
+
+private:
+  MTCaptureBuffer _buffer;
+  std::ostream *_os;
+  std::streambuf *_previous;
+};
+
+#ifdef MT_HAS_FORK
+// Captures everything written to a file descriptor, 1 for stdout, including
+// printf and the output of child processes. The descriptor is redirected to
+// an unlinked temporary file that is memory-mapped once the capture stops,
+// so the output is never copied.
+class MTFdCapture
+{
+public:
+  explicit MTFdCapture(int fd = STDOUT_FILENO) : _fd(fd)
+  {
+    _flush();
+
+    const char *dir = std::getenv("TMPDIR");
+    std::string path = std::string(dir ? dir : "/tmp") + "/mtest-capture-XXXXXX";
+    _file = mkstemp(&path[0]);
+    if (_file < 0)
+      throw std::runtime_error("mtest: unable to create a capture file");
+    unlink(path.c_str());
+
+    _saved = dup(_fd);
+    if (_saved < 0 || dup2(_file, _fd) < 0)
+    {
+      close(_file);
+      throw std::runtime_error("mtest: unable to redirect the descriptor");
+    }
+  }
+
+  ~MTFdCapture()
+  {
+    stop();
+    if (_data != nullptr)
+      munmap(_data, _size);
+    close(_file);
+  }
+
+  MTFdCapture(const MTFdCapture &) = delete;
+  MTFdCapture &operator=(const MTFdCapture &) = delete;
+
+  // Puts the descriptor back and maps what was written
+  void stop()
+  {
+    if (_saved < 0)
+      return;
+
+    _flush();
+    dup2(_saved, _fd);
+    close(_saved);
+    _saved = -1;
+
+    struct stat info;
+    if (fstat(_file, &info) == 0 && info.st_size > 0)
+    {
+      void *data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, _file, 0);
+      if (data != MAP_FAILED)
+      {
+        _data = data;
+        _size = info.st_size;
+      }
+    }
+  }
+
+  // Stops the capture if needed and returns the output
+  std::string_view view()
+  {
+    stop();
+    return std::string_view(static_cast<const char *>(_data), _size);
+  }
+
+private:
+  void _flush()
+  {
+    // Output still buffered by the C and C++ streams belongs to whoever
+    // wrote it before the switch
+    std::cout.flush();
+    std::cerr.flush();
+    std::fflush(nullptr);
+  }
+
+  int _fd;
+  int _file = -1;
+  int _saved = -1;
+  void *_data = nullptr;
+  std::size_t _size = 0;
+};
+#endif
+
+// A snapshot of the resources used so far: CPU time and allocations of the
+// calling thread, peak RSS of the process
+struct MTUsage
+{
+  std::chrono::steady_clock::time_point wall;
+  std::chrono::microseconds user{0};
+  std::chrono::microseconds system{0};
+  long peakRssKb = 0;
+  std::uint64_t allocations = 0;
+  std::uint64_t allocatedBytes = 0;
+
+  static MTUsage now()
+  {
+    MTUsage usage;
+    usage.wall = std::chrono::steady_clock::now();
+    usage.allocations = MTAllocations::count;
+    usage.allocatedBytes = MTAllocations::bytes;
+
+#ifdef MT_HAS_FORK
+    rusage self;
+#ifdef RUSAGE_THREAD
+    getrusage(RUSAGE_THREAD, &self);
+#else
+    getrusage(RUSAGE_SELF, &self);
+#endif
+    using std::chrono::seconds;
+    using std::chrono::microseconds;
+    usage.user = seconds(self.ru_utime.tv_sec) + microseconds(self.ru_utime.tv_usec);
+    usage.system = seconds(self.ru_stime.tv_sec) + microseconds(self.ru_stime.tv_usec);
+
+    // The peak is only kept per process, in bytes on macOS
+    getrusage(RUSAGE_SELF, &self);
+#ifdef __APPLE__
+    usage.peakRssKb = self.ru_maxrss / 1024;
+#else
+    usage.peakRssKb = self.ru_maxrss;
+#endif
+#endif
+    return usage;
+  }
+};
+
+// What a test used while it ran. The peak RSS delta is how much the test
+// raised the peak of the process, so it is only meaningful for tests run
+// one at a time.
+struct MTResources
+{
+  std::chrono::nanoseconds wall{0};
+  std::chrono::microseconds user{0};
+  std::chrono::microseconds system{0};
+  long peakRssDeltaKb = 0;
+  std::uint64_t allocations = 0;
+  std::uint64_t allocatedBytes = 0;
+
+  MTResources &operator+=(const MTResources &other)
+  {
+    wall += other.wall;
+    user += other.user;
+    system += other.system;
+    peakRssDeltaKb += other.peakRssDeltaKb;
+    allocations += other.allocations;
+    allocatedBytes += other.allocatedBytes;
+    return *this;
+  }
+
+  static MTResources between(const MTUsage &begin, const MTUsage &end)
+  {
+    return MTResources{end.wall - begin.wall,
+                       end.user - begin.user,
+                       end.system - begin.system,
+                       end.peakRssKb - begin.peakRssKb,
+                       end.allocations - begin.allocations,
+                       end.allocatedBytes - begin.allocatedBytes};
+  }
+};
+
+// Collects the output of a reporter and hands it to the stream in one write
+// per commit, without flushing on every line.
+class MTWriter
+{
+public:
+  explicit MTWriter(std::ostream &os) : _os(os)
+  {
+  }
+
+  MTWriter &operator<<(std::string_view str)
+  {
+    _buffer.append(str.data(), str.size());
+    return *this;
+  }
+
+  MTWriter &operator<<(const char *str)
+  {
+    return *this << std::string_view(str);
+  }
+
+  MTWriter &operator<<(char c)
+  {
+    _buffer.push_back(c);
+    return *this;
+  }
+
+  template <typename T,
+            typename = std::enable_if_t<std::is_arithmetic_v<T>>>
+  MTWriter &operator<<(T value)
+  {
+    char digits[32];
+    int n;
+    if constexpr (std::is_floating_point_v<T>)
+      n = std::snprintf(digits, sizeof(digits), "%g", double(value));
+    else if constexpr (std::is_signed_v<T>)
+      n = std::snprintf(digits, sizeof(digits), "%lld", (long long)value);
+    else
+      n = std::snprintf(digits, sizeof(digits), "%llu", (unsigned long long)value);
+    _buffer.append(digits, n);
+    return *this;
+  }
+
+  // Writes out everything buffered so far and flushes the stream once
+  void commit()
+  {
+    _os.write(_buffer.data(), _buffer.size());
+    _os.flush();
+    _buffer.clear();
+  }
+
+private:
+  std::ostream &_os;
+  std::string _buffer;
+};
+
+// Receives the results of a run. Tests are handed over in id order, each one
+// as soon as it and all the tests before it have finished.
+class MTReporter
+{
+public:
+  virtual ~MTReporter() = default;
+
+  // Called with the number of tests selected for the run
+  virtual void begin_run(std::size_t /* nTests */)
+  {
+  }
+
+  virtual void test_done(const MTTest &test, MTRecordStore::View records,
+                         bool passed, const MTResources &resources) = 0;
+
+  // Called before end_run with the weighted score of the run and of each
+  // rubric category
+  virtual void end_score(const MTScore & /* total */,
+                         const std::map<std::string_view, MTScore> & /* categories */)
+  {
+  }
+
+  virtual void end_run(std::size_t /* passed */, std::size_t /* total */)
+  {
+  }
+};
+
+// The default reporter: colored, human-readable text, optionally followed
+// by the slowest tests of the run
+class MTConsoleReporter : public MTReporter
+{
+public:
+  explicit MTConsoleReporter(std::ostream &os = std::cout, std::size_t slowest = 0)
+      : _out(os), _slowest(slowest)
+  {
+  }
+
+  // Lists the n slowest tests at the end of the run
+  void show_slowest(std::size_t n)
+  {
+    _slowest = n;
+  }
+
+  void begin_run(std::size_t /* nTests */) override
+  {
+    _times.clear();
+  }
+
+  void test_done(const MTTest &test, MTRecordStore::View records,
+                 bool passed, const MTResources &resources) override
+  {
+    _out << "\u001b[32m[RUNNING " << test.name << "]\033[0m\n";
+    // For each record in the test
+    for (const auto &rec : records)
+    {
+      if (rec.pass || !rec.printable)
+        continue;
+
+      _out << "  \u001b[31m[TEST CASE FAILED]\n    Reason: ";
+      if (rec.reason.empty())
+        _out << "no provided";
+      else
+        _out << "\u001b[31m" << rec.reason << "\033[0m\n";
+      _out << "\033[0m";
+    }
+    if (std::size_t dropped = records.dropped_failures())
+      _out << "  \u001b[31m(" << dropped << " more failures not shown)\033[0m\n";
+
+    if (passed)
+    {
+      _out << "  \u001b[32m[PASSED]\033[0m\n";
+    } else {
+      _out << "  \u001b[31mFeedback: " << test.feedback << "\033[0m\n";
+    }
+    _out.commit();
+
+    if (_slowest == 0)
+      return;
+
+    // Only keep the slowest so far, sorted from the slowest
+    auto slower = [](const auto &a, const auto &b) {
+      return a.first > b.first;
+    };
+    _times.insert(std::upper_bound(_times.begin(), _times.end(),
+                                   std::make_pair(resources.wall, test.name), slower),
+                  std::make_pair(resources.wall, test.name));
+    if (_times.size() > _slowest)
+      _times.pop_back();
+  }
+
+  void end_score(const MTScore &total,
+                 const std::map<std::string_view, MTScore> &categories) override
+  {
+    _score = total;
+    _categories = categories;
+  }
+
+  void end_run(std::size_t passed, std::size_t total) override
+  {
+    int percentage = MTSummary{passed, total}.percentage();
+    _out << "\n\u001b[32m" << percentage << "% of test passed\033[0m\n";
+
+    if (_score.empty != 0)
+      _out << _score.empty << " test(s) made no assertion\n";
+
+    // Only when weights or categories make the score differ from the count
+    if (!_categories.empty() || _score.earned != passed || _score.possible != total)
+    {
+      _out << "\nScore: " << _score.earned << " / " << _score.possible << " ("
+           << _score.percentage() << "%)\n";
+      for (const auto &[category, score] : _categories)
+      {
+        _out << "  " << category << ": " << score.earned << " / "
+             << score.possible << " (" << score.percentage() << "%)\n";
+      }
+    }
+    _score = {};
+    _categories.clear();
+
+    if (!_times.empty())
+    {
+      _out << "\nSlowest tests:\n";
+      for (const auto &[wall, name] : _times)
+      {
+        _out << "  " << std::chrono::duration<double, std::milli>(wall).count()
+             << " ms  " << name << '\n';
+      }
+    }
+    _out.commit();
+  }
+
+private:
+  MTWriter _out;
+  std::size_t _slowest;
+  std::vector<std::pair<std::chrono::nanoseconds, std::string_view>> _times;
+  MTScore _score;
+  std::map<std::string_view, MTScore> _categories;
+};
+
+// Writes one JSON object per line: one per test, then a summary
+class MTJsonLinesReporter : public MTReporter
+{
+public:
+  explicit MTJsonLinesReporter(std::ostream &os) : _out(os)
+  {
+  }
+
+  // Announces how many tests will be reported, so a reader can tell a run
+  // that stopped early from a short one
+  void begin_run(std::size_t nTests) override
+  {
+    _out << "{\"run\":{\"tests\":" << nTests << "}}\n";
+    _out.commit();
+  }
+
+  void test_done(const MTTest &test, MTRecordStore::View records,
+                 bool passed, const MTResources &resources) override
+  {
+    _out << "{\"id\":" << test.id << ",\"name\":";
+    _string(test.name);
+    _out << ",\"passed\":" << (passed ? "true" : "false")
+         << ",\"assertions\":" << records.size() << ",\"records\":[";
+
+    // Passing records without a reason carry no information
+    bool first = true;
+    for (const auto &rec : records)
+    {
+      if (rec.pass && rec.reason.empty())
+        continue;
+
+      _out << (first ? "" : ",") << "{\"pass\":" << (rec.pass ? "true" : "false")
+           << ",\"reason\":";
+      _string(rec.reason);
+      if (rec.file != nullptr)
+      {
+        _out << ",\"file\":";
+        _string(rec.file);
+        _out << ",\"line\":" << rec.line;
+      }
+      _out << '}';
+      first = false;
+    }
+    _out << "],\"feedback\":";
+    _string(test.feedback);
+    _out << ",\"wall_ns\":" << resources.wall.count()
+         << ",\"user_us\":" << resources.user.count()
+         << ",\"system_us\":" << resources.system.count()
+         << ",\"peak_rss_delta_kb\":" << resources.peakRssDeltaKb
+         << ",\"allocations\":" << resources.allocations
+         << ",\"allocated_bytes\":" << resources.allocatedBytes << "}\n";
+    _out.commit();
+  }
+
+  void end_score(const MTScore &total,
+                 const std::map<std::string_view, MTScore> &categories) override
+  {
+    _score = total;
+    for (const auto &[category, score] : categories)
+    {
+      _out << "{\"category\":";
+      _string(category);
+      _out << ",\"earned\":" << score.earned << ",\"possible\":" << score.possible
+           << ",\"empty\":" << score.empty << "}\n";
+    }
+    _out.commit();
+  }
+
+  void end_run(std::size_t passed, std::size_t total) override
+  {
+    _out << "{\"summary\":{\"passed\":" << passed << ",\"total\":" << total
+         << ",\"earned\":" << _score.earned << ",\"possible\":" << _score.possible
+         << ",\"empty\":" << _score.empty << "}}\n";
+    _out.commit();
+    _score = {};
+  }
+
+private:
+  void _string(std::string_view str)
+  {
+    _out << '"';
+    for (char c : str)
+    {
+      switch (c)
+      {
+      case '"': _out << "\\\""; break;
+      case '\\': _out << "\\\\"; break;
+      case '\n': _out << "\\n"; break;
+      case '\t': _out << "\\t"; break;
+      default:
+        if (static_cast<unsigned char>(c) < 0x20)
+        {
+          char escaped[8];
+          std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+          _out << escaped;
+        }
+        else
+        {
+          _out << c;
+        }
+      }
+    }
+    _out << '"';
+  }
+
+  MTWriter _out;
+  MTScore _score;
+};
+
+// Writes a JUnit XML document, one <testcase> element per test as it finishes
+class MTJUnitReporter : public MTReporter
+{
+public:
+  explicit MTJUnitReporter(std::ostream &os, std::string_view suite = "mtest")
+      : _out(os), _suite(suite)
+  {
+  }
+
+  void begin_run(std::size_t /* nTests */) override
+  {
+    _out << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<testsuite name=\"";
+    _escape(_suite);
+    _out << "\">\n";
+    _out.commit();
+  }
+
+  void test_done(const MTTest &test, MTRecordStore::View records,
+                 bool passed, const MTResources &resources) override
+  {
+    _out << "  <testcase classname=\"";
+    _escape(_suite);
+    _out << "\" name=\"";
+    _escape(test.name);
+    _out << "\" time=\""
+         << std::chrono::duration<double>(resources.wall).count() << '"';
+    if (passed)
+    {
+      _out << "/>\n";
+      _out.commit();
+      return;
+    }
+
+    _out << ">\n    <failure message=\"";
+    _escape(test.feedback);
+    _out << "\">";
+    for (const auto &rec : records)
+    {
+      if (!rec.pass)
+      {
+        _escape(rec.reason);
+        _out << '\n';
+      }
+    }
+    if (std::size_t dropped = records.dropped_failures())
+      _out << '(' << dropped << " more failures not shown)\n";
+    _out << "</failure>\n  </testcase>\n";
+    _out.commit();
+  }
+
+  void end_run(std::size_t /* passed */, std::size_t /* total */) override
+  {
+    _out << "</testsuite>\n";
+    _out.commit();
+  }
+
+private:
+  void _escape(std::string_view str)
+  {
+    for (char c : str)
+    {
+      switch (c)
+      {
+      case '<': _out << "&lt;"; break;
+      case '>': _out << "&gt;"; break;
+      case '&': _out << "&amp;"; break;
+      case '"': _out << "&quot;"; break;
+      default:
+        // Control characters other than tab and newline are not valid XML
+        if (static_cast<unsigned char>(c) >= 0x20 || c == '\t' || c == '\n')
+          _out << c;
+      }
+    }
+  }
+
+  MTWriter _out;
+  std::string _suite;
+};
+
+#ifdef MT_HAS_FORK
+// A test executable run by MTBatch, e.g. one per submission
+struct MTJob
+{
+  std::string name;
+  std::string path;
+  std::vector<std::string> args;
+};
+
+// What a batch collected from one job
+struct MTJobResult
+{
+  std::string name;
+  MTSummary summary;
+  // The number of tests the job announced, zero if it never did
+  std::size_t expected = 0;
+  // Every test reported, in report order
+  std::vector<std::pair<std::string, bool>> tests;
+  // Time spent in the tests, as they reported it, and in the whole process
+  std::chrono::nanoseconds testTime{0};
+  std::chrono::nanoseconds wall{0};
+  // Empty if the job exited normally, what went wrong otherwise
+  std::string error;
+};
+
+struct MTBatchOptions
+{
+  unsigned int nJobs = std::max(1u, std::thread::hardware_concurrency());
+  // Wall-clock limit of a job, zero for none
+  std::chrono::milliseconds timeout{0};
+  // File keeping the test times of earlier batches, none if empty
+  std::string history;
+};
+
+// Runs many test executables at a bounded parallelism and gathers their
+// results in one gradebook. Each job is started with MTEST_RESULTS pointing
+// at a pipe, which makes its MTEnv stream JSON Lines there while its own
+// stdout is discarded. Jobs expected to take longest start first, from the
+// test times recorded in the history file, so stragglers don't start last.
+class MTBatch
+{
+public:
+  explicit MTBatch(MTBatchOptions options = {}) : _options(std::move(options))
+  {
+    _loadHistory();
+  }
+
+  void add(MTJob job)
+  {
+    _jobs.push_back(std::move(job));
+  }
+
+  // Runs every job and returns the results in the order the jobs were added
+  const std::vector<MTJobResult> &run()
+  {
+    std::vector<std::size_t> order(_jobs.size());
+    std::vector<std::chrono::nanoseconds> expected(_jobs.size());
+    for (std::size_t i = 0; i < _jobs.size(); i++)
+    {
+      order[i] = i;
+      expected[i] = expected_time(_jobs[i].name);
+    }
+    std::stable_sort(order.begin(), order.end(), [&expected](std::size_t a, std::size_t b) {
+      return expected[a] > expected[b];
+    });
+
+    _results.assign(_jobs.size(), MTJobResult{});
+    std::vector<_Running> running;
+    std::size_t next = 0;
+    while (next < order.size() || !running.empty())
+    {
+      while (running.size() < std::max(1u, _options.nJobs) && next < order.size())
+      {
+        running.push_back(_start(order[next++]));
+      }
+
+      int timeout = -1;
+      auto now = std::chrono::steady_clock::now();
+      std::vector<pollfd> fds;
+      for (const auto &r : running)
+      {
+        fds.push_back(pollfd{r.fd, POLLIN, 0});
+        if (_options.timeout.count() > 0 && !r.killed)
+        {
+          auto left = std::chrono::ceil<std::chrono::milliseconds>(r.deadline - now).count();
+          int ms = int(std::max<decltype(left)>(left, 0));
+          timeout = timeout < 0 ? ms : std::min(timeout, ms);
+        }
+      }
+
+      if (poll(fds.data(), fds.size(), timeout) < 0 && errno != EINTR)
+        throw std::runtime_error("mtest: poll failed in batch");
+
+      now = std::chrono::steady_clock::now();
+      for (std::size_t i = running.size(); i-- > 0;)
+      {
+        _Running &r = running[i];
+        if (fds[i].revents != 0 && !_read(r))
+        {
+          _finish(r, now);
+          running.erase(running.begin() + i);
+        }
+        else if (_options.timeout.count() > 0 && !r.killed && now >= r.deadline)
+        {
+          // Keep reading until the pipe closes to get what it reported so far
+          kill(-r.pid, SIGKILL);
+          r.killed = true;
+        }
+      }
+    }
+
+    _saveHistory();
+    return _results;
+  }
+
+  const std::vector<MTJobResult> &results() const
+  {
+    return _results;
+  }
+
+  // How long the tests of a job are expected to take: what they took in the
+  // last batch, or for an unknown job the sum of the average time of every
+  // test seen so far
+  std::chrono::nanoseconds expected_time(const std::string &job) const
+  {
+    auto it = _jobTimes.find(job);
+    if (it != _jobTimes.end())
+      return it->second;
+
+    std::chrono::nanoseconds total{0};
+    for (const auto &[name, time] : _testTimes)
+    {
+      total += time.total / std::max<std::size_t>(time.count, 1);
+    }
+    return total;
+  }
+
+  // Writes one CSV line per job, plus a total line
+  void write_gradebook(std::ostream &os) const
+  {
+    MTSummary total;
+    os << "job,passed,total,percentage,wall_ms,error\n";
+    for (const auto &result : _results)
+    {
+      _csv(os, result.name);
+      os << ',' << result.summary.passed << ',' << result.summary.total << ','
+         << result.summary.percentage() << ','
+         << std::chrono::duration_cast<std::chrono::milliseconds>(result.wall).count()
+         << ',';
+      _csv(os, result.error);
+      os << '\n';
+      total += result.summary;
+    }
+    os << "total," << total.passed << ',' << total.total << ','
+       << total.percentage() << ",,\n";
+  }
+
+  // A ready-made driver: mtest-batch [-j<n>] [--timeout=<ms>]
+  //   [--history=<file>] [--gradebook=<file>] executable...
+  // Jobs are named after their executable. Returns 0 if every test passed.
+  static int main(int argc, char const *argv[])
+  {
+    MTBatchOptions options;
+    std::string gradebook;
+    std::vector<std::string> paths;
+    for (int i = 1; i < argc; i++)
+    {
+      std::string_view arg = argv[i];
+      if (arg.substr(0, 2) == "-j")
+        options.nJobs = std::strtoul(argv[i] + 2, nullptr, 10);
+      else if (arg.substr(0, 10) == "--timeout=")
+        options.timeout = std::chrono::milliseconds(std::strtoul(argv[i] + 10, nullptr, 10));
+      else if (arg.substr(0, 10) == "--history=")
+        options.history = std::string(arg.substr(10));
+      else if (arg.substr(0, 12) == "--gradebook=")
+        gradebook = std::string(arg.substr(12));
+      else
+        paths.emplace_back(arg);
+    }
+
+    MTBatch batch(options);
+    for (const auto &path : paths)
+    {
+      batch.add(MTJob{path, path, {}});
+    }
+
+    bool passed = true;
+    for (const auto &result : batch.run())
+    {
+      passed = passed && result.error.empty() &&
+               result.summary.passed == result.summary.total;
+    }
+
+    if (gradebook.empty())
+    {
+      batch.write_gradebook(std::cout);
+    }
+    else
+    {
+      std::ofstream out(gradebook);
+      batch.write_gradebook(out);
+    }
+    return passed ? 0 : 1;
+  }
+
+private:
+  struct _Running
+  {
+    std::size_t job;
+    pid_t pid;
+    int fd;
+    std::string pending;
+    std::chrono::steady_clock::time_point start;
+    std::chrono::steady_clock::time_point deadline;
+    bool killed = false;
+  };
+
+  struct _TestTime
+  {
+    std::chrono::nanoseconds total{0};
+    std::size_t count = 0;
+  };
+
+  _Running _start(std::size_t job)
+  {
+    int fds[2];
+    if (pipe(fds) != 0)
+      throw std::runtime_error("mtest: unable to create a job pipe");
+    // Later jobs must not inherit this pipe, or it never reaches EOF
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+
+    std::vector<std::string> args{_jobs[job].path};
+    args.insert(args.end(), _jobs[job].args.begin(), _jobs[job].args.end());
+    std::vector<char *> argv;
+    for (auto &arg : args)
+    {
+      argv.push_back(&arg[0]);
+    }
+    argv.push_back(nullptr);
+
+    pid_t pid = fork();
+    if (pid < 0)
+      throw std::runtime_error("mtest: unable to fork a job");
+
+    if (pid == 0)
+    {
+      // In its own group so a timeout also kills what the job started. The
+      // parent does the same, whichever runs first.
+      setpgid(0, 0);
+      int results = 3;
+      if (fds[1] != results)
+      {
+        dup2(fds[1], results);
+        close(fds[1]);
+      }
+      int null = open("/dev/null", O_RDWR);
+      dup2(null, STDIN_FILENO);
+      dup2(null, STDOUT_FILENO);
+      setenv("MTEST_RESULTS", "/dev/fd/3", 1);
+      execv(argv[0], argv.data());
+      _exit(127);
+    }
+
+    setpgid(pid, pid);
+    close(fds[1]);
+    auto now = std::chrono::steady_clock::now();
+    _results[job].name = _jobs[job].name;
+    return _Running{job, pid, fds[0], {}, now, now + _options.timeout};
+  }
+
+  // Reads what is available and handles every complete line. Returns false
+  // at the end of the output.
+  bool _read(_Running &r)
+  {
+    char buffer[4096];
+    ssize_t n = ::read(r.fd, buffer, sizeof(buffer));
+    if (n < 0 && errno == EINTR)
+      return true;
+    if (n <= 0)
+      return false;
+
+    r.pending.append(buffer, n);
+    std::size_t begin = 0;
+    for (std::size_t end; (end = r.pending.find('\n', begin)) != std::string::npos; begin = end + 1)
+    {
+      _line(_results[r.job], std::string_view(r.pending).substr(begin, end - begin));
+    }
+    r.pending.erase(0, begin);
+    return true;
+  }
+
+  void _line(MTJobResult &result, std::string_view line)
+  {
+    if (auto summary = MTSummary::parse(line))
+    {
+      result.summary = *summary;
+      return;
+    }
+    if (line.substr(0, 16) == "{\"run\":{\"tests\":")
+    {
+      result.expected = std::strtoull(std::string(line.substr(16)).c_str(), nullptr, 10);
+      return;
+    }
+
+    std::optional<std::string> name;
+    std::optional<bool> passed;
+    std::int64_t wall = 0;
+    _fields(line, [&](std::string_view key, std::string_view value) {
+      if (key == "name")
+        name = _unescape(value);
+      else if (key == "passed")
+        passed = value == "true";
+      else if (key == "wall_ns")
+        wall = std::strtoll(std::string(value).c_str(), nullptr, 10);
+    });
+    if (!name || !passed)
+      return;
+
+    result.tests.emplace_back(*name, *passed);
+    result.testTime += std::chrono::nanoseconds(wall);
+    _TestTime &time = _testTimes[*name];
+    time.total += std::chrono::nanoseconds(wall);
+    time.count++;
+  }
+
+  void _finish(_Running &r, std::chrono::steady_clock::time_point now)
+  {
+    close(r.fd);
+    int status = 0;
+    waitpid(r.pid, &status, 0);
+
+    MTJobResult &result = _results[r.job];
+    result.wall = now - r.start;
+    if (r.killed)
+      result.error = "timed out";
+    else if (WIFSIGNALED(status))
+      result.error = "killed by signal " + std::to_string(WTERMSIG(status));
+    else if (WIFEXITED(status) && WEXITSTATUS(status) == 127)
+      result.error = "could not be started";
+
+    // Without a summary line, the tests announced but never reported
+    // failed. A job that did not even announce its tests gets no points.
+    if (result.summary.total == 0 && (result.expected != 0 || !result.tests.empty()))
+    {
+      if (result.error.empty())
+        result.error = "exited before its summary";
+      std::size_t passed = 0;
+      for (const auto &[name, ok] : result.tests)
+      {
+        passed += ok;
+      }
+      if (result.expected == 0)
+      {
+        passed = 0;
+        result.error += ", scored 0 since its number of tests is unknown";
+      }
+      result.summary.total = std::max(result.expected, result.tests.size());
+      result.summary.passed = passed;
+      result.summary.score.earned = double(passed);
+      result.summary.score.possible = double(result.summary.total);
+    }
+    // A job cut short by its timeout took at least that long
+    _jobTimes[result.name] = std::max(result.testTime, result.wall);
+  }
+
+  // Calls f(key, raw value) for each member of a flat JSON object, skipping
+  // over nested arrays and objects
+  template <typename F>
+  static void _fields(std::string_view line, F f)
+  {
+    std::size_t i = line.find('{');
+    if (i == std::string_view::npos)
+      return;
+
+    auto string = [&line](std::size_t at) {
+      std::size_t end = at + 1;
+      while (end < line.size() && line[end] != '"')
+        end += line[end] == '\\' ? 2 : 1;
+      return std::min(end, line.size());
+    };
+
+    for (i++; i < line.size();)
+    {
+      if (line[i] != '"')
+      {
+        i++;
+        continue;
+      }
+
+      std::size_t keyEnd = string(i);
+      std::string_view key = line.substr(i + 1, keyEnd - i - 1);
+      std::size_t at = line.find(':', keyEnd);
+      if (at == std::string_view::npos)
+        return;
+
+      std::size_t begin = at + 1, end = begin;
+      if (begin < line.size() && line[begin] == '"')
+      {
+        end = string(begin);
+        f(key, line.substr(begin + 1, end - begin - 1));
+        end++;
+      }
+      else if (begin < line.size() && (line[begin] == '[' || line[begin] == '{'))
+      {
+        int depth = 0;
+        for (; end < line.size(); end++)
+        {
+          if (line[end] == '"')
+            end = string(end);
+          else if (line[end] == '[' || line[end] == '{')
+            depth++;
+          else if ((line[end] == ']' || line[end] == '}') && --depth == 0)
+            break;
+        }
+        end++;
+      }
+      else
+      {
+        while (end < line.size() && line[end] != ',' && line[end] != '}')
+          end++;
+        f(key, line.substr(begin, end - begin));
+      }
+      i = end;
+    }
+  }
+
+  static std::string _unescape(std::string_view str)
+  {
+    std::string out;
+    for (std::size_t i = 0; i < str.size(); i++)
+    {
+      if (str[i] != '\\' || i + 1 == str.size())
+      {
+        out += str[i];
+        continue;
+      }
+
+      char c = str[++i];
+      if (c == 'n')
+        out += '\n';
+      else if (c == 't')
+        out += '\t';
+      else if (c == 'u' && i + 4 < str.size())
+      {
+        out += char(std::strtol(std::string(str.substr(i + 1, 4)).c_str(), nullptr, 16));
+        i += 4;
+      }
+      else
+        out += c;
+    }
+    return out;
+  }
+
+  static void _csv(std::ostream &os, std::string_view field)
+  {
+    if (field.find_first_of(",\"\n") == std::string_view::npos)
+    {
+      os << field;
+      return;
+    }
+
+    os << '"';
+    for (char c : field)
+    {
+      os << c;
+      if (c == '"')
+        os << '"';
+    }
+    os << '"';
+  }
+
+  // The history has one line per job and per test:
+  //   job <nanoseconds> <name>
+  //   test <total nanoseconds> <runs> <name>
+  void _loadHistory()
+  {
+    if (_options.history.empty())
+      return;
+
+    std::ifstream in(_options.history);
+    std::string kind;
+    while (in >> kind)
+    {
+      std::int64_t ns;
+      std::size_t count = 0;
+      std::string name;
+      if (kind == "job" && in >> ns && std::getline(in >> std::ws, name))
+        _jobTimes[name] = std::chrono::nanoseconds(ns);
+      else if (kind == "test" && in >> ns >> count && std::getline(in >> std::ws, name))
+        _testTimes[name] = _TestTime{std::chrono::nanoseconds(ns), count};
+      else
+        return;
+    }
+  }
+
+  void _saveHistory() const
+  {
+    if (_options.history.empty())
+      return;
+
+    std::string temporary = _options.history + ".tmp";
+    {
+      std::ofstream out(temporary);
+      for (const auto &[name, time] : _jobTimes)
+      {
+        out << "job " << time.count() << ' ' << name << '\n';
+      }
+      for (const auto &[name, time] : _testTimes)
+      {
+        out << "test " << time.total.count() << ' ' << time.count << ' ' << name << '\n';
+      }
+      if (!out)
+        return;
+    }
+    std::rename(temporary.c_str(), _options.history.c_str());
+  }
+
+  MTBatchOptions _options;
+  std::vector<MTJob> _jobs;
+  std::vector<MTJobResult> _results;
+  std::map<std::string, std::chrono::nanoseconds> _jobTimes;
+  std::map<std::string, _TestTime> _testTimes;
+};
+#endif
+
+class MTEnv
+{
+public:
+  MTEnv(bool showComp = false) : _currentTest(nullptr)
+  {
+  }
+
+  ~MTEnv() = default;
+
+  // Non-copyable and non-movable
+  MTEnv(MTEnv &) = delete;
+  MTEnv(MTEnv &&) = delete;
+  MTEnv &operator=(MTEnv &) = delete;
+  MTEnv &&operator=(MTEnv &&) = delete;
+
+  // Adds a test to the environment. A test is a tuple containing:
+  // (name, feedback, function)
+  void add_test(std::tuple<std::string, std::string, MTFunction> t)
+  {
+    auto &[name, feedback, func] = t;
+    _tests.push_back(MTTest{_idCounter,
+                            _strings.intern(name),
+                            _strings.intern(feedback),
+                            std::move(func)});
+    _idCounter++;
+  }
+
+  // Adds a test without going through a tuple. The name and feedback are
+  // copied once into the environment, so temporaries are fine. A body
+  // without captures is stored as a plain function pointer, anything else
+  // is moved into an MTFunction.
+  template <typename F>
+  void add_test(std::string_view name, std::string_view feedback, F &&f)
+  {
+    _addTest(_strings.intern(name), _strings.intern(feedback),
+             std::forward<F>(f));
+  }
+
+#ifdef MT_HAS_COROUTINES
+  // Adds a coroutine test. The body is called as body(env, loop) and may
+  // co_await the timers and descriptors of the loop. run_all_parallel keeps
+  // many of them waiting on each worker; the other runners run them one at a
+  // time. Like the add_test above, the name and feedback are copied.
+  template <typename F>
+  void add_co_test(std::string_view name, std::string_view feedback, F &&body)
+  {
+    _tests.push_back(MTTest{_idCounter, _strings.intern(name),
+                            _strings.intern(feedback), {}, nullptr,
+                            MTCoFunction(std::forward<F>(body))});
+    _idCounter++;
+  }
+#endif
+
+  // Reserves room for n tests ahead of a large registration
+  void reserve(std::size_t n)
+  {
+    _tests.reserve(n);
+  }
+
+  // Lists the n slowest tests at the end of the default console report
+  void show_slowest(std::size_t n)
+  {
+    _console.show_slowest(n);
+  }
+
+  // What a test used during the last run
+  const MTResources &resources(int id) const
+  {
+    return _resources.at(id);
+  }
+
+  // Sends the results of the runs to reporter. Once a reporter is added the
+  // console one is no longer used by default; add an MTConsoleReporter to
+  // keep it alongside.
+  void add_reporter(std::unique_ptr<MTReporter> reporter)
+  {
+    _reporters.push_back(std::move(reporter));
+  }
+
+  // Same as above but takes a list of tuples in the following form:
+  // { (name, feedback, function)* }
+  void add_test(
+      const std::initializer_list<std::tuple<std::string, std::string, MTFunction>> &tests)
+  {
+    for (const auto &test : tests)
+    {
+      add_test(test);
+    }
+  }
+
+  // Adds one test per value of params, named "name [value]", or "name [#i]"
+  // when the values can't be printed. The body is called as f(env, value).
+  template <typename Params, typename F>
+  void add_test_p(std::string_view name, std::string_view feedback,
+                  const Params &params, F f)
+  {
+    using T = std::decay_t<decltype(*std::begin(params))>;
+    auto values = std::make_shared<const std::vector<T>>(std::begin(params),
+                                                         std::end(params));
+    auto body = std::make_shared<const F>(std::move(f));
+    feedback = _strings.intern(feedback);
+
+    for (std::size_t i = 0; i < values->size(); i++)
+    {
+      std::stringstream label;
+      label << name << " [";
+      if constexpr (MTStreamable<T>::value)
+        label << (*values)[i];
+      else
+        label << '#' << i;
+      label << "]";
+
+      _addTest(_strings.intern(label.str()), feedback,
+               [values, body, i](MTEnv &env) {
+                 (*body)(env, (*values)[i]);
+               });
+    }
+  }
+
+  template <typename T, typename F>
+  void add_test_p(std::string_view name, std::string_view feedback,
+                  std::initializer_list<T> params, F f)
+  {
+    add_test_p(name, feedback, std::vector<T>(params), std::move(f));
+  }
+
+  // Adds a property checked on options.cases values made by gen. property is
+  // either bool(const T &) or void(MTEnv &, const T &) using the usual
+  // assertions. The first failing value is shrunk to a simpler one that still
+  // fails, and reported with its case number and seed.
+  template <typename T, typename Property>
+  void add_property(std::string_view name, std::string_view feedback,
+                    MTGen<T> gen, Property property, MTPropertyOptions options = {})
+  {
+    auto shared = std::make_shared<const std::pair<MTGen<T>, Property>>(
+        std::move(gen), std::move(property));
+    std::size_t batchSize = std::max<std::size_t>(options.batchSize, 1);
+    feedback = _strings.intern(feedback);
+
+    for (std::size_t first = 0; first < options.cases; first += batchSize)
+    {
+      std::size_t last = std::min(options.cases, first + batchSize);
+      std::string_view label;
+      if (batchSize < options.cases)
+      {
+        std::stringstream ss;
+        ss << name << " [cases " << first << "-" << last - 1 << "]";
+        label = _strings.intern(ss.str());
+      }
+      else
+      {
+        label = _strings.intern(name);
+      }
+
+      _addTest(label, feedback, [shared, options, first, last](MTEnv &env) {
+        env._checkProperty(shared->first, shared->second, options, first, last);
+      });
+    }
+  }
+
+  // Keeps the results in a cache file. A selected test whose id, name, build
+  // id and input hash match a cached result is not run again; its records are
+  // replayed from the cache. inputHash gives the hash of what a test depends
+  // on, e.g. MTResultCache::hash_file of the submission. Replayed tests report
+  // no resource usage.
+  void use_cache(const std::string &path,
+                 std::function<std::uint64_t(std::string_view name)> inputHash,
+                 std::string buildId = MTResultCache::executable_id())
+  {
+    _cache = std::make_unique<MTResultCache>(path, std::move(buildId));
+    _cacheInput = std::move(inputHash);
+  }
+
+  // Same as above with one input hash for every test
+  void use_cache(const std::string &path, std::uint64_t inputHash,
+                 std::string buildId = MTResultCache::executable_id())
+  {
+    use_cache(path, [inputHash](std::string_view) { return inputHash; },
+              std::move(buildId));
+  }
+
+  // Writes a Chrome trace of the runs to path when each ends, sampling one
+  // assertion in every `sampling`. Tests run by run_all_isolated are traced
+  // as a whole, since their assertions are made in the workers.
+  void trace_to(const std::string &path, std::size_t sampling = 1000)
+  {
+    _tracePath = path;
+    _trace = std::make_unique<MTTrace>(sampling);
+  }
+
+  // The seed of the properties that don't set their own
+  void set_seed(std::uint64_t seed)
+  {
+    _seed = seed;
+  }
+
+  // Weighs the tests registered so far whose name matches a glob pattern.
+  // With partial credit a failing test still earns the share of its weight
+  // that its passing assertions make up.
+  void set_weight(std::string_view glob, double weight, bool partial = false)
+  {
+    for (auto &test : _tests)
+    {
+      if (_globMatch(glob, test.name))
+      {
+        test.weight = weight;
+        test.partial = partial;
+      }
+    }
+  }
+
+  // Puts the tests registered so far whose name matches a glob pattern in a
+  // rubric category, scored on its own in addition to the total
+  void set_category(std::string_view glob, std::string_view category)
+  {
+    category = _strings.intern(category);
+    for (auto &test : _tests)
+    {
+      if (_globMatch(glob, test.name))
+        test.category = category;
+    }
+  }
+
+  // Whether the tests that make no assertion pass. They fail by default.
+  void set_empty_tests_pass(bool pass)
+  {
+    _emptyTestsPass = pass;
+  }
+
+  // Runs the tests in an order shuffled with the seed (see set_seed), so tests
+  // relying on state left by earlier ones show up. Dependencies still hold,
+  // and reports keep the id order.
+  void set_shuffle(bool shuffle)
+  {
+    _shuffle = shuffle;
+  }
+
+  // Makes the tests registered so far whose name matches glob start only
+  // after every test matching dependencyGlob has finished
+  void depends_on(std::string_view glob, std::string_view dependencyGlob)
+  {
+    _after.resize(_tests.size());
+    for (const auto &test : _tests)
+    {
+      if (!_globMatch(glob, test.name))
+        continue;
+      for (const auto &dependency : _tests)
+      {
+        if (dependency.id != test.id && _globMatch(dependencyGlob, dependency.name))
+          _after[test.id].push_back(dependency.id);
+      }
+    }
+  }
+
+  // Tags the tests registered so far whose name matches glob with a resource,
+  // e.g. "port 8080". The parallel and isolated runners never run two tests
+  // holding the same resource at once.
+  void uses_resource(std::string_view glob, std::string_view resource)
+  {
+    auto [it, added] = _resourceIds.emplace(std::string(resource), _resourceIds.size());
+    _uses.resize(_tests.size());
+    for (const auto &test : _tests)
+    {
+      if (_globMatch(glob, test.name))
+        _uses[test.id].push_back(it->second);
+    }
+  }
+
+  // The running score of the current or last run, up to the last test
+  // reported
+  const MTScore &score() const
+  {
+    return _score;
+  }
+
+  const std::map<std::string_view, MTScore> &category_scores() const
+  {
+    return _categories;
+  }
+
+  // Only runs the tests whose name matches a glob pattern, where * matches any
+  // sequence of characters and ? any single one
+  void filter(std::string_view glob)
+  {
+    _glob = std::string(glob);
+  }
+
+  // Only runs the tests whose name matches a regular expression. Built with
+  // MT_NO_REGEX it throws std::invalid_argument instead.
+  void filter_regex(const std::string &pattern)
+  {
+#ifndef MT_NO_REGEX
+    _nameMatches = [regex = std::regex(pattern)](std::string_view name) {
+      return std::regex_search(name.begin(), name.end(), regex);
+    };
+#else
+    throw std::invalid_argument("mtest: --regex needs a build without MT_NO_REGEX");
+#endif
+  }
+
+  // Only runs the tests with an id in [first, last]
+  void filter_ids(int first, int last)
+  {
+    _firstId = first;
+    _lastId = last;
+  }
+
+  // Only runs the tests of shard index out of count. Tests are assigned by a
+  // stable hash of their name, so every machine agrees on the split without
+  // talking to the others.
+  void shard(std::size_t index, std::size_t count)
+  {
+    if (count == 0 || index >= count)
+      throw std::invalid_argument("mtest: shard index must be below the count");
+
+    _shardIndex = index;
+    _shardCount = count;
+  }
+
+  // Applies the selection options found in the command line:
+  //   --filter=<glob> --regex=<pattern> --ids=<first>-<last> --shard=<i>/<n>
+  // and the seed of the property tests, --seed=<n>. Other arguments are left to the program.
+  void parse_args(int argc, char const *argv[])
+  {
+    for (int i = 1; i < argc; i++)
+    {
+      std::string_view arg = argv[i];
+      auto value = [arg](std::string_view option) -> std::optional<std::string> {
+        if (arg.substr(0, option.size()) != option)
+          return {};
+        return std::string(arg.substr(option.size()));
+      };
+
+      if (auto glob = value("--filter="))
+      {
+        filter(*glob);
+      }
+      else if (auto pattern = value("--regex="))
+      {
+        filter_regex(*pattern);
+      }
+      else if (auto ids = value("--ids="))
+      {
+        int first, last;
+        if (std::sscanf(ids->c_str(), "%d-%d", &first, &last) != 2)
+          throw std::invalid_argument("mtest: expected --ids=<first>-<last>");
+        filter_ids(first, last);
+      }
+      else if (auto split = value("--shard="))
+      {
+        std::size_t index, count;
+        if (std::sscanf(split->c_str(), "%zu/%zu", &index, &count) != 2)
+          throw std::invalid_argument("mtest: expected --shard=<i>/<n>");
+        shard(index, count);
+      }
+      else if (auto seed = value("--seed="))
+      {
+        set_seed(std::strtoull(seed->c_str(), nullptr, 0));
+      }
+      else if (arg == "--shuffle")
+      {
+        set_shuffle(true);
+      }
+    }
+  }
+
+  // Registers a suite fixture: an object built by setup the first time a test
+  // asks for it and then shared, read-only, by every test of the environment,
+  // parallel workers included. Teardown is the destructor of T, run when the
+  // environment is destroyed. Fixtures must be added before running.
+  template <typename T, typename Setup>
+  void add_fixture(Setup setup)
+  {
+    auto slot = std::make_unique<_SharedFixture<T>>();
+    slot->setup = std::move(setup);
+    _addFixture(_fixtureId<_SharedFixture<T>>(), std::move(slot));
+  }
+
+  template <typename T>
+  void add_fixture()
+  {
+    add_fixture<T>([] { return T(); });
+  }
+
+  // The suite fixture of type T, built on first use
+  template <typename T>
+  const T &fixture()
+  {
+    auto &slot = _getFixture<_SharedFixture<T>>();
+    std::call_once(slot.once, [&slot] {
+      slot.value = std::make_unique<T>(slot.setup());
+    });
+    return *slot.value;
+  }
+
+  // Registers a per-test fixture. Each worker builds its own instance with
+  // setup the first time it asks for one; after that, every new test that
+  // asks for it gets the same instance passed through reset, which is meant
+  // to be much cheaper than building it again.
+  template <typename T, typename Setup, typename Reset>
+  void add_test_fixture(Setup setup, Reset reset)
+  {
+    auto slot = std::make_unique<_TestFixture<T>>();
+    slot->setup = std::move(setup);
+    slot->reset = std::move(reset);
+    _addFixture(_fixtureId<_TestFixture<T>>(), std::move(slot));
+  }
+
+  // The per-test fixture of type T of the calling worker, reset for the
+  // current test
+  template <typename T>
+  T &test_fixture()
+  {
+    auto &slot = _getFixture<_TestFixture<T>>();
+    std::uint64_t tag = (_runCount << 32) | std::uint64_t(_currentId());
+    std::thread::id thread = std::this_thread::get_id();
+
+    typename _TestFixture<T>::Instance *instance = nullptr;
+    {
+      std::lock_guard<std::mutex> lock(slot.mutex);
+      for (auto &candidate : slot.instances)
+      {
+        if (candidate.thread == thread)
+          instance = &candidate;
+      }
+
+      if (instance == nullptr)
+      {
+        slot.instances.push_back({thread, std::make_unique<T>(slot.setup()), tag});
+        return *slot.instances.back().value;
+      }
+    }
+
+    // The instance is only ever used by this thread
+    if (instance->tag != tag)
+    {
+      slot.reset(*instance->value);
+      instance->tag = tag;
+    }
+    return *instance->value;
+  }
+
+  // Keeps the details of at most n failed assertions per test; the others
+  // are only counted. Passes without a reason are always only counted.
+  void set_failures_kept(std::size_t n)
+  {
+    _failuresKept = n;
+    _records.keep_failures(n);
+  }
+
+  // Ends each test at its first failed assertion instead of running the rest
+  // of its assertions
+  void set_fail_fast(bool failFast)
+  {
+    _failFast = failFast;
+  }
+
+  // Stops a run once n tests have failed. The tests left are not run and are
+  // reported as failed. Zero, the default, never stops.
+  void set_max_failures(std::size_t n)
+  {
+    _maxFailures = n;
+  }
+
+  // Run all the test in the environment
+  void run_all(bool report = true, bool verbose = false)
+  {
+    _beginRun(report);
+    _EndOnUnwind end{this};
+    _runThread = std::this_thread::get_id();
+    std::for_each(
+        _order.begin(),
+        _order.end(),
+        [this](std::size_t id) {
+          MTTest &it = _tests[id];
+          if (!_runs(it.id))
+            return;
+
+          if (_stopping())
+          {
+            _skipTest(it);
+            return;
+          }
+
+          _currentTest = &it;
+          _runningTest = it.id;
+          _failed = false;
+          if (_trace)
+            _trace->begin_test();
+          MTUsage begin = MTUsage::now();
+          // Each function needs the environment, thus *this
+          try {
+            it.run(*this);
+          } catch(const MTAbortTest &) {
+          }
+          _resources[it.id] = MTResources::between(begin, MTUsage::now());
+          if (_trace)
+            _trace->test(it.name, begin.wall, _resources[it.id].wall);
+          if (_drainThreads(it.id, _records, it.id))
+            _failed = true;
+
+          if (_failed)
+            _failedTests++;
+          _finishTest(it.id);
+        });
+    _currentTest = nullptr;
+    _runningTest = -1;
+    _runThread = {};
+    _endRun();
+  }
+
+  // Run all the tests in the environment over a work-stealing pool of
+  // nThreads workers. Records are collected per test and handed to the
+  // reporters in test-id order, so the report is the same as from run_all.
+  void run_all_parallel(unsigned int nThreads = std::thread::hardware_concurrency(),
+                        bool report = true, bool verbose = false)
+  {
+    if (nThreads == 0)
+      nThreads = 1;
+
+    // One store per worker, emptied into _records after each test, so memory
+    // does not grow with the size of the suite
+    std::vector<MTRecordStore> stores(nThreads);
+    for (auto &store : stores)
+    {
+      store.keep_failures(_failuresKept);
+    }
+    std::vector<std::exception_ptr> errors(_tests.size());
+    std::mutex finishMutex;
+    std::vector<MTWorkQueue> queues(nThreads);
+
+    _beginRun(report);
+    _EndOnUnwind end{this};
+
+    // With dependencies or resources, a worker out of tests waits for the
+    // ones still running to make others ready
+    bool constrained = !_after.empty() || !_resourceIds.empty();
+    std::mutex scheduleMutex;
+    std::condition_variable scheduled;
+    std::size_t unfinished = 0;
+
+    // Deal the ready tests round-robin so every worker starts with a share
+    for (std::size_t i : _order)
+    {
+      if (!_runs(i))
+        continue;
+      if (_schedule.blockers[i] == 0)
+        queues[unfinished % nThreads].push(i);
+      unfinished++;
+    }
+
+    // Frees the resources of a test and queues the tests it was holding back
+    auto release = [&](std::size_t id, unsigned int self) {
+      if (!constrained)
+        return;
+
+      std::vector<std::size_t> ready;
+      {
+        std::lock_guard<std::mutex> lock(scheduleMutex);
+        _schedule.release(id, _usesOf(id), ready);
+        for (std::size_t r : ready)
+        {
+          queues[self].push(r);
+        }
+        unfinished--;
+      }
+      scheduled.notify_all();
+    };
+
+    auto finish = [&](const MTTest &test, MTContext &context, unsigned int self) {
+      if (_drainThreads(test.id, *context.records, 0))
+        context.failed = true;
+      if (context.failed)
+        _failedTests++;
+
+      {
+        std::lock_guard<std::mutex> lock(finishMutex);
+        _records.append(test.id, *context.records, 0);
+        context.records->clear();
+        // A test that threw is rethrown at the end, not replayed later
+        _finishTest(test.id, !errors[test.id]);
+      }
+      release(test.id, self);
+    };
+
+    auto worker = [&](unsigned int self) {
+#ifdef MT_HAS_COROUTINES
+      // Coroutine tests started by this worker wait here while it runs others
+      MTEventLoop loop;
+      std::map<std::size_t, _CoRun> running;
+#endif
+      for (;;)
+      {
+        std::optional<std::size_t> index = queues[self].pop();
+        for (unsigned int k = 1; !index && k < nThreads; k++)
+        {
+          index = queues[(self + k) % nThreads].steal();
+        }
+
+#ifdef MT_HAS_COROUTINES
+        if (!loop.empty())
+          loop.run_once(std::chrono::milliseconds(0));
+        if (!index && !loop.empty())
+        {
+          // The coroutines finishing may make other tests ready
+          loop.run();
+          continue;
+        }
+#endif
+        if (!index)
+        {
+          if (!constrained)
+            return;
+
+          std::unique_lock<std::mutex> lock(scheduleMutex);
+          if (unfinished == 0)
+            return;
+          scheduled.wait(lock);
+          continue;
+        }
+
+        if (constrained)
+        {
+          // Parked until the resource it waits for is released
+          std::lock_guard<std::mutex> lock(scheduleMutex);
+          if (!_schedule.acquire(*index, _usesOf(*index)))
+            continue;
+        }
+
+        const MTTest &test = _tests[*index];
+        if (_stopping())
+        {
+          {
+            std::lock_guard<std::mutex> lock(finishMutex);
+            _skipTest(test);
+          }
+          release(test.id, self);
+          continue;
+        }
+
+#ifdef MT_HAS_COROUTINES
+        if (test.co)
+        {
+          // The test is current only while one of its coroutines runs, and
+          // its resources are what it used during those slices. It has a
+          // store of its own since others run on the worker in between.
+          _CoRun *run = &running.try_emplace(test.id).first->second;
+          run->records.keep_failures(_failuresKept);
+          run->context = MTContext{this, &test, &run->records};
+          auto resume = [this, run](std::coroutine_handle<> h) {
+            _context = &run->context;
+            MTUsage begin = MTUsage::now();
+            h.resume();
+            run->used += MTResources::between(begin, MTUsage::now());
+            _context = nullptr;
+          };
+          auto done = [&, run, self, id = test.id](MTTask &task) {
+            try {
+              if (std::exception_ptr error = task.error())
+                std::rethrow_exception(error);
+            } catch(const MTAbortTest &) {
+            } catch(...) {
+              errors[id] = std::current_exception();
+            }
+            run->used.wall = MTEventLoop::Clock::now() - run->start;
+            _resources[id] = run->used;
+            if (_trace)
+              _trace->test(_tests[id].name, run->start, run->used.wall);
+            finish(_tests[id], run->context, self);
+            running.erase(id);
+          };
+          loop.spawn(test.co(*this, loop), resume, done);
+          continue;
+        }
+#endif
+
+        MTContext context{this, &test, &stores[self]};
+        _context = &context;
+        if (_trace)
+          _trace->begin_test();
+        MTUsage begin = MTUsage::now();
+        try {
+          test.run(*this);
+        } catch(const MTAbortTest &) {
+        } catch(...) {
+          errors[*index] = std::current_exception();
+        }
+        _resources[test.id] = MTResources::between(begin, MTUsage::now());
+        if (_trace)
+          _trace->test(test.name, begin.wall, _resources[test.id].wall);
+        _context = nullptr;
+        finish(test, context, self);
+      }
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned int i = 1; i < nThreads; i++)
+    {
+      workers.emplace_back(worker, i);
+    }
+    worker(0);
+
+    for (auto &w : workers)
+    {
+      w.join();
+    }
+
+    // Surface the first escaped exception the same way run_all would have
+    for (const auto &error : errors)
+    {
+      if (error)
+        std::rethrow_exception(error);
+    }
+
+    _endRun();
+  }
+
+#ifdef MT_HAS_FORK
+  // Run all the tests in the environment inside a pool of pre-forked worker
+  // processes. Each worker runs one test at a time and sends its records back
+  // over a pipe. A worker that crashes, or that exceeds the wall-clock or CPU
+  // limit of the options, is replaced and its test is recorded as failed, so
+  // the rest of the run is not lost.
+  void run_all_isolated(MTIsolation options = {}, bool report = true,
+                        bool verbose = false)
+  {
+    unsigned int nWorkers = std::max(1u, options.nWorkers);
+
+    std::vector<_Worker> workers;
+    std::size_t done = 0;
+
+    // A write to a dead worker must fail with EPIPE instead of killing us
+    struct sigaction ignore = {}, previous = {};
+    ignore.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &ignore, &previous);
+
+    _beginRun(report);
+    std::cout.flush();
+    for (unsigned int i = 0; i < nWorkers; i++)
+    {
+      workers.push_back(_spawnWorker(workers, options));
+    }
+
+    // The tests whose dependencies have finished, in run order
+    std::deque<std::size_t> ready;
+    for (std::size_t i : _order)
+    {
+      if (!_runs(i))
+        done++;
+      else if (_schedule.blockers[i] == 0)
+        ready.push_back(i);
+    }
+
+    auto complete = [&](std::size_t index) {
+      std::vector<std::size_t> released;
+      _schedule.release(index, _usesOf(index), released);
+      ready.insert(ready.end(), released.begin(), released.end());
+      done++;
+    };
+
+    while (done < _tests.size())
+    {
+      auto now = std::chrono::steady_clock::now();
+
+      // Hand out ready tests to idle workers
+      for (auto &w : workers)
+      {
+        if (w.test)
+          continue;
+
+        std::optional<std::uint32_t> next;
+        while (!next && !ready.empty())
+        {
+          std::size_t candidate = ready.front();
+          ready.pop_front();
+          if (_schedule.acquire(candidate, _usesOf(candidate)))
+            next = candidate;
+        }
+        if (!next)
+          break;
+
+        std::uint32_t index = *next;
+        if (_stopping())
+        {
+          _skipTest(_tests[index]);
+          complete(index);
+          continue;
+        }
+
+        w.test = index;
+        w.deadline = now + options.wallLimit;
+        if (!_writeAll(w.command, &index, sizeof(index)))
+        {
+          _replaceWorker(w, workers, options, "Worker process died");
+          _failedTests++;
+          _finishTest(index, false);
+          complete(index);
+        }
+      }
+
+      std::vector<pollfd> fds;
+      std::vector<_Worker *> polled;
+      int timeout = -1;
+      for (auto &w : workers)
+      {
+        if (!w.test)
+          continue;
+
+        fds.push_back(pollfd{w.result, POLLIN, 0});
+        polled.push_back(&w);
+        if (options.wallLimit.count() > 0)
+        {
+          auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+              w.deadline - now);
+          int ms = std::max<int>(0, left.count());
+          timeout = timeout < 0 ? ms : std::min(timeout, ms);
+        }
+      }
+
+      if (fds.empty())
+        continue;
+
+      if (poll(fds.data(), fds.size(), timeout) < 0 && errno != EINTR)
+        break;
+
+      now = std::chrono::steady_clock::now();
+      for (std::size_t i = 0; i < fds.size(); i++)
+      {
+        _Worker &w = *polled[i];
+        std::size_t index = *w.test;
+
+        // A crash or a timeout may be flaky, so it is not cached
+        bool cache = true;
+        if (fds[i].revents != 0)
+        {
+          bool retire = false;
+          if (_readRecords(w.result, index, _resources[index], retire))
+          {
+            if (retire)
+              _replaceWorker(w, workers, options, nullptr);
+            w.test.reset();
+          }
+          else
+          {
+            _replaceWorker(w, workers, options, "Test crashed");
+            cache = false;
+          }
+        }
+        else if (options.wallLimit.count() > 0 && now >= w.deadline)
+        {
+          kill(w.pid, SIGKILL);
+          _replaceWorker(w, workers, options, "Test timed out");
+          cache = false;
+        }
+        else
+        {
+          continue;
+        }
+
+        if (_records.records(index).failed != 0)
+          _failedTests++;
+        if (_trace)
+        {
+          auto wall = std::chrono::duration_cast<MTTrace::Clock::duration>(
+              _resources[index].wall);
+          _trace->test(_tests[index].name, now - wall, wall, int(&w - workers.data()));
+        }
+        _finishTest(index, cache);
+        complete(index);
+      }
+    }
+
+    for (auto &w : workers)
+    {
+      close(w.command);
+      close(w.result);
+      waitpid(w.pid, nullptr, 0);
+    }
+    sigaction(SIGPIPE, &previous, nullptr);
+
+    _endRun();
+  }
+#endif
+
+  template <typename... Types,
+            typename Comp = std::function<bool(const Types &...)>>
+  void expect(Types... args, std::string reason, Comp c, bool printable,
+              MTLocation where = MTLocation::current())
+  {
+    expect_deferred<Types...>(
+        args...,
+        [&reason](std::ostream &os) {
+          os << reason;
+        },
+        c, printable, where);
+  }
+
+  // Same as expect, but the reason is produced by calling fmt(std::ostream&)
+  // only when the comparison fails, so a passing assertion does no formatting
+  // and no allocation for its reason.
+  template <typename... Types, typename Fmt, typename Comp>
+  void expect_deferred(const Types &... args, Fmt fmt, Comp c, bool printable,
+                       MTLocation where = MTLocation::current())
+  {
+    if (_skipping())
+      return;
+
+    if (c(args...) == true)
+    {
+      _insertRecord(true, printable, {}, where);
+    }
+    else
+    {
+      std::stringstream ss;
+      fmt(ss);
+      _insertRecord(false, printable, ss.str(), where);
+    }
+  }
+
+  // Records an expression decomposed by MT_CHECK. On failure the reason is
+  // the expression with the values of its operands and where it is.
+  template <typename Expr>
+  void check(const Expr &expr, std::string_view text, MTLocation where,
+             bool printable = true)
+  {
+    if (_skipping())
+      return;
+
+    if (expr.passed())
+    {
+      _insertRecord(true, printable, {}, where);
+      return;
+    }
+
+    std::stringstream ss;
+    ss << std::boolalpha << where.file << ':' << where.line << ": " << text << " (";
+    expr.describe(ss);
+    ss << ')';
+    _insertRecord(false, printable, ss.str(), where);
+  }
+
+  // Assert equality within the environment
+  template <typename T>
+  void expect_eq(const T &l, const T &r, bool printable = true,
+                 MTLocation where = MTLocation::current())
+  {
+    expect_deferred<T, T>(l, r,
+                          [&](std::ostream &os) {
+                            os << l << " != " << r;
+                          },
+                          [](const T &l, const T &r) {
+                            return l == r;
+                          }, printable, where);
+  }
+
+  template <typename T>
+  void expect_neq(const T &l, const T &r, bool printable = true,
+                  MTLocation where = MTLocation::current())
+  {
+    expect_deferred<T, T>(l, r,
+                          [&](std::ostream &os) {
+                            os << l << " == " << r;
+                          },
+                          [](const T &l, const T &r) {
+                            return l != r;
+                          }, printable, where);
+  }
+
+  void expect_true(bool val, bool printable = true,
+                   MTLocation where = MTLocation::current())
+  {
+    expect_deferred<bool>(val,
+                          [](std::ostream &os) {
+                            os << "value is false";
+                          },
+                          [](bool val) {
+                            return val == true;
+                          }, printable, where);
+  }
+
+  void expect_false(bool val, bool printable = true,
+                    MTLocation where = MTLocation::current())
+  {
+    expect_deferred<bool>(val,
+                          [](std::ostream &os) {
+                            os << "value is true";
+                          },
+                          [](bool val) {
+                            return val == false;
+                          }, printable, where);
+  }
+
+  /* Runs F and expect E, otherwise fails. */
+  template <typename E, typename F = std::function<void()>>
+  void expect_except(const F& f, bool printable = false,
+                     MTLocation where = MTLocation::current())
+  {
+    bool passed = false;
+
+    try {
+      f();
+    } catch(const E&) {
+      passed = true;
+    }
+
+    expect_deferred<bool>(passed,
+                          [](std::ostream &os) {
+                            os << typeid(E).name() << " did not occur.";
+                          },
+                          [](bool val) {
+                            return val == true;
+                          }, printable, where);
+  }
+
+  /* Runs F and assert that at least one exception is thrown, otherwise fails. */
+  template<typename F = std::function<void()>>
+  void expect_any_except(const F& f, bool printable = false,
+                         MTLocation where = MTLocation::current())
+  {
+    bool passed = false;
+
+    try {
+      f();
+    } catch(const MTAbortTest &) {
+      throw;
+    } catch(...) {
+      passed = true;
+    }
+
+    expect_deferred<bool>(passed,
+                          [](std::ostream &os) {
+                            os << "No exception occured.";
+                          },
+                          [](bool val) {
+                            return val == true;
+                          }, printable, where);
+  }
+
+  /* Runs F and assert that no expections are thrown, otherwise fails. */
+  template<typename F = std::function<void()>>
+  void expect_no_except(const F& f, bool printable = false,
+                        MTLocation where = MTLocation::current())
+  {
+    bool passed = true;
+    std::exception_ptr except;
+
+    try {
+      f();
+    } catch(const MTAbortTest &) {
+      throw;
+    } catch(...) {
+      passed = false;
+      except = std::current_exception();
+    }
+
+    expect_deferred<bool>(passed,
+                          [&except](std::ostream &os) {
+                            os << "Exception " << typeid(except).name() << " occured.";
+                          },
+                          [](bool val) {
+                            return val == true;
+                          }, printable, where);
+  }
+
+  // Starts a thread whose assertions count for the calling test. Threads
+  // started another way are attributed to the test being run by run_all or
+  // by an isolated worker. That is ambiguous in run_all_parallel, where
+  // their assertions are ignored with a warning.
+  template <typename F, typename... Args>
+  std::thread start_thread(F &&f, Args &&...args)
+  {
+    return std::thread(
+        [this, test = _currentId(), run = _runCount.load()](auto body, auto... params) {
+          _owner = _Owner{this, test, run};
+          std::invoke(body, params...);
+        },
+        std::forward<F>(f), std::forward<Args>(args)...);
+  }
+
+  // Asserts that f returns within budget. f runs on a helper thread while the
+  // test waits for it; what it throws is rethrown here. When the budget runs
+  // out the assertion fails and the call is abandoned: it keeps running in
+  // the background, so f must not capture the test's locals by reference or
+  // use anything else the test destroys. The assertions it makes from then on
+  // are dropped. In run_all_isolated the worker is replaced once the test
+  // ends instead, which kills the call.
+  template <typename F = std::function<void()>>
+  void expect_completes_within(std::chrono::nanoseconds budget, const F &f,
+                               bool printable = false,
+                               MTLocation where = MTLocation::current())
+  {
+    if (_skipping())
+      return;
+
+    struct Call
+    {
+      std::mutex mutex;
+      std::condition_variable done;
+      bool finished = false;
+      std::exception_ptr error;
+    };
+
+    auto call = std::make_shared<Call>();
+    std::thread watched([this, call, test = _currentId(), run = _runCount.load(), f]() {
+      // Assertions made by f belong to the test that waits for it
+      _owner = _Owner{this, test, run};
+      std::exception_ptr error;
+      try {
+        f();
+      } catch(...) {
+        error = std::current_exception();
+      }
+
+      std::lock_guard<std::mutex> lock(call->mutex);
+      call->error = error;
+      call->finished = true;
+      call->done.notify_one();
+    });
+
+    bool finished;
+    {
+      std::unique_lock<std::mutex> lock(call->mutex);
+      finished = call->done.wait_for(lock, budget, [&call] {
+        return call->finished;
+      });
+    }
+
+    if (finished)
+    {
+      watched.join();
+      if (call->error)
+        std::rethrow_exception(call->error);
+    }
+    else
+    {
+      watched.detach();
+      if (_isolatedWorker)
+        _retireWorker = true;
+    }
+
+    expect_deferred<bool>(finished,
+                          [&budget](std::ostream &os) {
+                            os << "Call did not complete within ";
+                            _printDuration(os, budget);
+                          },
+                          [](bool val) {
+                            return val == true;
+                          }, printable, where);
+  }
+
+  // Asserts that two contiguous ranges (vectors, arrays, strings...) have the
+  // same size and equal elements. The whole range makes a single record, and
+  // a failure reports the first index that differs.
+  template <typename L, typename R>
+  void expect_range_eq(const L &l, const R &r, bool printable = true,
+                       MTLocation where = MTLocation::current())
+  {
+    expect_range_eq(std::data(l), std::size(l), std::data(r), std::size(r),
+                    printable, where);
+  }
+
+  // Same as above for ranges given as a pointer and a size
+  template <typename T>
+  void expect_range_eq(const T *l, std::size_t nl, const T *r, std::size_t nr,
+                       bool printable = true,
+                       MTLocation where = MTLocation::current())
+  {
+    if (_skipping())
+      return;
+
+    std::size_t at = nl;
+    if (nl == nr)
+    {
+      // Integers, enums and pointers are equal exactly when their bytes are
+      if constexpr (std::is_integral_v<T> || std::is_enum_v<T> ||
+                    std::is_pointer_v<T>)
+      {
+        if (nl != 0 && std::memcmp(l, r, nl * sizeof(T)) != 0)
+          at = _mismatch(l, r, nl, std::equal_to<T>());
+      }
+      else
+      {
+        at = _mismatch(l, r, nl, std::equal_to<T>());
+      }
+    }
+
+    _insertRange(l, nl, r, nr, at, " != ", printable, where);
+  }
+
+  // Asserts that |l - r| <= eps
+  template <typename T>
+  void expect_near(const T &l, const T &r, const std::common_type_t<T> &eps,
+                   bool printable = true,
+                   MTLocation where = MTLocation::current())
+  {
+    expect_deferred<T, T>(l, r,
+                          [&](std::ostream &os) {
+                            os.precision(std::numeric_limits<T>::max_digits10);
+                            os << l << " is not within " << eps << " of " << r;
+                          },
+                          [&eps](const T &l, const T &r) {
+                            return MTFloat::near(l, r, eps);
+                          }, printable, where);
+  }
+
+  // Asserts that |l - r| <= rel * max(|l|, |r|)
+  template <typename T>
+  void expect_rel_near(const T &l, const T &r, const std::common_type_t<T> &rel,
+                       bool printable = true,
+                       MTLocation where = MTLocation::current())
+  {
+    expect_deferred<T, T>(l, r,
+                          [&](std::ostream &os) {
+                            os.precision(std::numeric_limits<T>::max_digits10);
+                            os << l << " is not within a relative " << rel
+                               << " of " << r;
+                          },
+                          [&rel](const T &l, const T &r) {
+                            return MTFloat::rel_near(l, r, rel);
+                          }, printable, where);
+  }
+
+  // Asserts that l and r are at most n representable values apart
+  template <typename T>
+  void expect_ulps(const T &l, const T &r, std::uint64_t n, bool printable = true,
+                   MTLocation where = MTLocation::current())
+  {
+    expect_deferred<T, T>(l, r,
+                          [&](std::ostream &os) {
+                            os.precision(std::numeric_limits<T>::max_digits10);
+                            os << l << " is " << MTFloat::ulp_distance(l, r)
+                               << " ulps from " << r << ", more than " << n;
+                          },
+                          [n](const T &l, const T &r) {
+                            return MTFloat::ulps(l, r, n);
+                          }, printable, where);
+  }
+
+  // Range versions of the three above: a single record for the whole range
+  template <typename L, typename R, typename T>
+  void expect_all_near(const L &l, const R &r, T eps, bool printable = true,
+                       MTLocation where = MTLocation::current())
+  {
+    _expectAll(l, r, [eps](auto x, auto y) {
+      return MTFloat::near(x, y, decltype(x)(eps));
+    }, " is not near ", printable, where);
+  }
+
+  template <typename L, typename R, typename T>
+  void expect_all_rel_near(const L &l, const R &r, T rel, bool printable = true,
+                           MTLocation where = MTLocation::current())
+  {
+    _expectAll(l, r, [rel](auto x, auto y) {
+      return MTFloat::rel_near(x, y, decltype(x)(rel));
+    }, " is not relatively near ", printable, where);
+  }
+
+  template <typename L, typename R>
+  void expect_all_ulps(const L &l, const R &r, std::uint64_t n,
+                       bool printable = true,
+                       MTLocation where = MTLocation::current())
+  {
+    _expectAll(l, r, [n](auto x, auto y) {
+      return MTFloat::ulps(x, y, n);
+    }, " is too many ulps from ", printable, where);
+  }
+
+  // Starts capturing std::cout; the output is in the view() of the result
+  static std::unique_ptr<MTStreamCapture> capture_stdout()
+  {
+    return std::make_unique<MTStreamCapture>(std::cout);
+  }
+
+#ifdef MT_HAS_FORK
+  // Starts capturing a file descriptor, 1 (stdout) by default
+  static std::unique_ptr<MTFdCapture> capture_fd(int fd = STDOUT_FILENO)
+  {
+    return std::make_unique<MTFdCapture>(fd);
+  }
+#endif
+
+  // Asserts that produced is exactly expected. A failure reports the first
+  // line and column that differ, which suits long captured outputs.
+  void expect_output_eq(std::string_view produced, std::string_view expected,
+                        bool printable = true,
+                        MTLocation where = MTLocation::current())
+  {
+    if (_skipping())
+      return;
+
+    MTTextMatcher matcher(expected);
+    matcher.feed(produced);
+    expect_deferred<bool>(matcher.finish(),
+                          [&](std::ostream &os) {
+                            os << "output differs at ";
+                            matcher.describe(os);
+                          },
+                          [](bool val) {
+                            return val == true;
+                          }, printable, where);
+  }
+
+  // Maps a golden or input file into memory. Files are mapped once per
+  // environment and shared by the tests that ask for them.
+  const MTMappedFile &map_file(const std::string &path)
+  {
+    std::lock_guard<std::mutex> lock(_filesMutex);
+    auto it = _files.find(path);
+    if (it == _files.end())
+      it = _files.emplace(path, std::make_unique<MTMappedFile>(path)).first;
+    return *it->second;
+  }
+
+  // Asserts that produced is exactly the content of the file at path. A
+  // failure reports the first line and column that differ.
+  void expect_output_matches_file(std::string_view produced, const std::string &path,
+                                  bool printable = true,
+                                  MTLocation where = MTLocation::current())
+  {
+    _expectMatchesFile(path, printable, where, [produced](MTTextMatcher &matcher) {
+      matcher.feed(produced);
+    });
+  }
+
+  // Same as above, reading the output from a stream in chunks so it never
+  // has to be held in memory as a whole
+  void expect_output_matches_file(std::istream &produced, const std::string &path,
+                                  bool printable = true,
+                                  MTLocation where = MTLocation::current())
+  {
+    _expectMatchesFile(path, printable, where, [&produced](MTTextMatcher &matcher) {
+      char chunk[16 * 1024];
+      while (produced)
+      {
+        produced.read(chunk, sizeof(chunk));
+        if (!matcher.feed(std::string_view(chunk, produced.gcount())))
+          break;
+      }
+    });
+  }
+
+  // Runs F and asserts that it allocated nothing on the heap. This and the
+  // two below need MT_TRACK_ALLOCATIONS and only see the allocations made by
+  // the calling thread.
+  template <typename F = std::function<void()>>
+  void expect_no_alloc(const F &f, bool printable = true,
+                       MTLocation where = MTLocation::current())
+  {
+    _expectAllocations(f, printable, where, [](const MTAllocated &a, std::ostream *os) {
+      if (os != nullptr)
+        *os << a.count << " allocations (" << a.bytes << " bytes) were made";
+      return a.count == 0;
+    });
+  }
+
+  // Runs F and asserts that it allocated at most budget bytes in total
+  template <typename F = std::function<void()>>
+  void expect_alloc_below(const F &f, std::uint64_t budget, bool printable = true,
+                          MTLocation where = MTLocation::current())
+  {
+    _expectAllocations(f, printable, where, [budget](const MTAllocated &a, std::ostream *os) {
+      if (os != nullptr)
+        *os << a.bytes << " bytes were allocated, the budget is " << budget;
+      return a.bytes <= budget;
+    });
+  }
+
+  // Runs F and asserts that it freed everything it allocated
+  template <typename F = std::function<void()>>
+  void expect_no_leak(const F &f, bool printable = true,
+                      MTLocation where = MTLocation::current())
+  {
+    _expectAllocations(f, printable, where, [](const MTAllocated &a, std::ostream *os) {
+      if (os != nullptr)
+        *os << a.liveBytes() << " bytes in " << a.liveCount()
+            << " allocations were not freed";
+      return a.liveCount() == 0 && a.liveBytes() == 0;
+    });
+  }
+
+  // Keeps the compiler from optimizing away the computation of value, so
+  // the work measured by the benchmark assertions is really done.
+  template <typename T>
+  static void do_not_optimize(const T &value)
+  {
+#if defined(__GNUC__) || defined(__clang__)
+    asm volatile("" : : "r,m"(value) : "memory");
+#else
+    static volatile const void *sink;
+    sink = &value;
+#endif
+  }
+
+  // Runs F repeatedly on a steady clock and returns its median and p95 time
+  template <typename F>
+  static MTTiming measure(F &&f, const MTBenchmarkOptions &options = {})
+  {
+    using Clock = std::chrono::steady_clock;
+
+    for (std::size_t i = 0; i < options.warmup; i++)
+    {
+      f();
+    }
+
+    std::size_t round = std::max<std::size_t>(1, options.minSamples);
+    std::vector<std::chrono::nanoseconds> samples;
+    std::vector<std::chrono::nanoseconds> sorted;
+    std::optional<std::chrono::nanoseconds> lastMedian;
+    auto stop = Clock::now() + options.maxTime;
+
+    for (;;)
+    {
+      for (std::size_t i = 0; i < round; i++)
+      {
+        auto start = Clock::now();
+        f();
+        samples.push_back(Clock::now() - start);
+      }
+
+      sorted = samples;
+      std::sort(sorted.begin(), sorted.end());
+      auto median = sorted[sorted.size() / 2];
+
+      bool stable = lastMedian &&
+                    std::abs((median - *lastMedian).count()) <=
+                        options.tolerance * lastMedian->count();
+      if (stable || samples.size() >= options.maxSamples || Clock::now() >= stop)
+        break;
+
+      lastMedian = median;
+    }
+
+    std::size_t p95 = std::min(sorted.size() - 1, (sorted.size() * 95) / 100);
+    return MTTiming{sorted[sorted.size() / 2], sorted[p95], sorted.size()};
+  }
+
+  // Asserts that the median runtime of F is below budget. The timing is kept
+  // as the reason of the record whether it passes or not.
+  template <typename F, typename Rep, typename Period>
+  void expect_runtime_below(F &&f, std::chrono::duration<Rep, Period> budget,
+                            bool printable = true,
+                            const MTBenchmarkOptions &options = {},
+                            MTLocation where = MTLocation::current())
+  {
+    if (_skipping())
+      return;
+
+    MTTiming timing = measure(f, options);
+    bool passed = timing.median <= budget;
+
+    _insertTiming(passed, printable, where, timing, [&](std::ostream &os) {
+      os << " exceeds the budget of ";
+      _printDuration(os, budget);
+    });
+  }
+
+  // Asserts that the median runtime of F is at most ratio times the median
+  // runtime of reference, e.g. 0.5 for "twice as fast".
+  template <typename F, typename R>
+  void expect_faster_than(F &&f, R &&reference, double ratio = 1.0,
+                          bool printable = true,
+                          const MTBenchmarkOptions &options = {},
+                          MTLocation where = MTLocation::current())
+  {
+    if (_skipping())
+      return;
+
+    MTTiming timing = measure(f, options);
+    MTTiming base = measure(reference, options);
+    bool passed = timing.median.count() <= ratio * base.median.count();
+
+    _insertTiming(passed, printable, where, timing, [&](std::ostream &os) {
+      os << " against a reference median of ";
+      _printDuration(os, base.median);
+      os << " (allowed ratio " << ratio << ")";
+    });
+  }
+
+private:
+  // Adds a test whose name and feedback are already owned by the environment
+  template <typename F>
+  void _addTest(std::string_view name, std::string_view feedback, F &&f)
+  {
+    if constexpr (std::is_convertible_v<F, MTPlainFunction>)
+    {
+      _tests.push_back(MTTest{_idCounter, name, feedback, {}, f});
+    }
+    else
+    {
+      _tests.push_back(MTTest{_idCounter, name, feedback,
+                              MTFunction(std::forward<F>(f))});
+    }
+    _idCounter++;
+  }
+
+  template <typename Rep, typename Period>
+  static void _printDuration(std::ostream &os,
+                             std::chrono::duration<Rep, Period> duration)
+  {
+    double ns = std::chrono::duration<double, std::nano>(duration).count();
+    if (ns >= 1e9)
+      os << ns / 1e9 << " s";
+    else if (ns >= 1e6)
+      os << ns / 1e6 << " ms";
+    else if (ns >= 1e3)
+      os << ns / 1e3 << " us";
+    else
+      os << ns << " ns";
+  }
+
+  // Feeds the output to a matcher for the file at path and records the result
+  template <typename Feed>
+  void _expectMatchesFile(const std::string &path, bool printable,
+                          MTLocation where, Feed feed)
+  {
+    if (_skipping())
+      return;
+
+    const MTMappedFile *file;
+    try {
+      file = &map_file(path);
+    } catch(const std::runtime_error &e) {
+      _insertRecord(false, printable, e.what(), where);
+      return;
+    }
+
+    MTTextMatcher matcher(file->view());
+    feed(matcher);
+    expect_deferred<bool>(matcher.finish(),
+                          [&](std::ostream &os) {
+                            os << "output differs from " << path << " at ";
+                            matcher.describe(os);
+                          },
+                          [](bool val) {
+                            return val == true;
+                          }, printable, where);
+  }
+
+  // What a callable allocated and freed on the calling thread
+  struct MTAllocated
+  {
+    std::uint64_t count;
+    std::uint64_t bytes;
+    std::uint64_t frees;
+    std::uint64_t freedBytes;
+
+    std::int64_t liveCount() const { return std::int64_t(count - frees); }
+    std::int64_t liveBytes() const { return std::int64_t(bytes - freedBytes); }
+  };
+
+  // Runs F and records check(allocated, nullptr). On failure, check is called
+  // again with a stream to describe the failure.
+  template <typename F, typename Check>
+  void _expectAllocations(const F &f, bool printable, MTLocation where, Check check)
+  {
+    if (_skipping())
+      return;
+
+    if (!MTAllocations::enabled)
+    {
+      _insertRecord(false, printable,
+                    "Allocation tracking is off, define MT_TRACK_ALLOCATIONS", where);
+      return;
+    }
+
+    MTAllocated before{MTAllocations::count, MTAllocations::bytes,
+                       MTAllocations::frees, MTAllocations::freedBytes};
+    f();
+    MTAllocated used{MTAllocations::count - before.count,
+                     MTAllocations::bytes - before.bytes,
+                     MTAllocations::frees - before.frees,
+                     MTAllocations::freedBytes - before.freedBytes};
+
+    expect_deferred<MTAllocated>(used,
+                                 [&](std::ostream &os) {
+                                   check(used, &os);
+                                 },
+                                 [&check](const MTAllocated &used) {
+                                   return check(used, nullptr);
+                                 }, printable, where);
+  }
+
+  struct _Fixture
+  {
+    virtual ~_Fixture() = default;
+  };
+
+  template <typename T>
+  struct _SharedFixture : _Fixture
+  {
+    std::function<T()> setup;
+    std::once_flag once;
+    std::unique_ptr<T> value;
+  };
+
+  template <typename T>
+  struct _TestFixture : _Fixture
+  {
+    struct Instance
+    {
+      std::thread::id thread;
+      std::unique_ptr<T> value;
+      // The run and test the value was last reset for
+      std::uint64_t tag;
+    };
+
+    std::function<T()> setup;
+    std::function<void(T &)> reset;
+    std::mutex mutex;
+    std::deque<Instance> instances;
+  };
+
+  // Fixture slots are found by a small index per slot type, shared by all
+  // environments, instead of a map lookup
+  static inline std::atomic<std::size_t> _fixtureCount{0};
+
+  template <typename Slot>
+  static std::size_t _fixtureId()
+  {
+    static const std::size_t id = _fixtureCount++;
+    return id;
+  }
+
+  void _addFixture(std::size_t id, std::unique_ptr<_Fixture> slot)
+  {
+    if (id >= _fixtures.size())
+      _fixtures.resize(id + 1);
+    _fixtures[id] = std::move(slot);
+  }
+
+  template <typename Slot>
+  Slot &_getFixture()
+  {
+    std::size_t id = _fixtureId<Slot>();
+    if (id >= _fixtures.size() || !_fixtures[id])
+      throw std::logic_error("mtest: fixture used before being added");
+    return static_cast<Slot &>(*_fixtures[id]);
+  }
+
+  // The id of the test running on the calling thread
+  // The test being run by the calling thread. Throws std::logic_error when
+  // no test is running, e.g. for test_fixture called from main.
+  int _currentId() const
+  {
+    if (_context != nullptr && _context->env == this)
+      return _context->test->id;
+    if (_currentTest == nullptr)
+      throw std::logic_error("mtest: this call is only valid inside a running test");
+    return _currentTest->id;
+  }
+
+  // Index of the first i where !eq(l[i], r[i]), or n. Blocks are checked
+  // without branching so the compiler can vectorize the comparison; only a
+  // block that failed is scanned again for the exact index.
+  template <typename T, typename Eq>
+  static std::size_t _mismatch(const T *l, const T *r, std::size_t n, Eq eq)
+  {
+    constexpr std::size_t block = 256;
+    for (std::size_t begin = 0; begin < n; begin += block)
+    {
+      std::size_t end = std::min(n, begin + block);
+
+      bool same = true;
+      for (std::size_t i = begin; i < end; i++)
+      {
+        same &= bool(eq(l[i], r[i]));
+      }
+
+      if (same)
+        continue;
+
+      for (std::size_t i = begin; i < end; i++)
+      {
+        if (!eq(l[i], r[i]))
+          return i;
+      }
+    }
+    return n;
+  }
+
+  // Compares two contiguous ranges element-wise with eq
+  template <typename L, typename R, typename Eq>
+  void _expectAll(const L &l, const R &r, Eq eq, const char *op, bool printable,
+                  MTLocation where)
+  {
+    if (_skipping())
+      return;
+
+    const auto *dl = std::data(l);
+    const auto *dr = std::data(r);
+    std::size_t nl = std::size(l), nr = std::size(r);
+
+    std::size_t at = nl;
+    if (nl == nr)
+      at = _mismatch(dl, dr, nl, eq);
+
+    _insertRange(dl, nl, dr, nr, at, op, printable, where);
+  }
+
+  // Records the result of a range comparison where at is the first
+  // mismatching index, or nl when the ranges are equal
+  template <typename T>
+  void _insertRange(const T *l, std::size_t nl, const T *r, std::size_t nr,
+                    std::size_t at, const char *op, bool printable,
+                    MTLocation where)
+  {
+    bool passed = nl == nr && at == nl;
+    expect_deferred<bool>(passed,
+                          [&](std::ostream &os) {
+                            if (nl != nr)
+                            {
+                              os << "range sizes differ: " << nl << " != " << nr;
+                              return;
+                            }
+
+                            if constexpr (std::is_floating_point_v<T>)
+                              os.precision(std::numeric_limits<T>::max_digits10);
+                            os << "ranges differ at index " << at << ": ";
+                            mt_describe(os, l[at]);
+                            os << op;
+                            mt_describe(os, r[at]);
+                          },
+                          [](bool val) {
+                            return val == true;
+                          }, printable, where);
+  }
+
+  // Records a benchmark result, with the timing and, on failure, the
+  // details written by fmt as the reason.
+  template <typename Fmt>
+  void _insertTiming(bool passed, bool printable, MTLocation where,
+                     const MTTiming &timing, Fmt fmt)
+  {
+    std::stringstream ss;
+    ss << "median ";
+    _printDuration(ss, timing.median);
+    ss << ", p95 ";
+    _printDuration(ss, timing.p95);
+    ss << " over " << timing.samples << " runs";
+    if (!passed)
+      fmt(ss);
+    _insertRecord(passed, printable, ss.str(), where);
+  }
+
+  // Checks cases [first, last) of a property, each from its own stream of
+  // the seed so a batch does not depend on the ones before it
+  template <typename T, typename Property>
+  void _checkProperty(const MTGen<T> &gen, const Property &property,
+                      const MTPropertyOptions &options, std::size_t first,
+                      std::size_t last)
+  {
+    if (_skipping())
+      return;
+
+    std::uint64_t seed = options.seed ? *options.seed : _seed;
+    MTRecordStore scratch;
+    for (std::size_t n = first; n < last; n++)
+    {
+      MTRandom random(MTRandom::mix(seed, n));
+      T value = gen.generate(random);
+      if (_holds(property, value, scratch))
+        continue;
+
+      std::size_t steps = 0;
+      std::size_t tries = 0;
+      for (bool shrunk = true; shrunk && tries < options.maxShrinks;)
+      {
+        shrunk = false;
+        for (T &candidate : gen.shrink(value))
+        {
+          if (tries++ == options.maxShrinks)
+            break;
+          if (!_holds(property, candidate, scratch))
+          {
+            value = std::move(candidate);
+            steps++;
+            shrunk = true;
+            break;
+          }
+        }
+      }
+
+      std::stringstream reason;
+      reason << "property failed for case " << n << " (seed " << seed << ")";
+      if (steps != 0)
+        reason << ", shrunk " << steps << " times";
+      reason << ": ";
+      mt_describe(reason, value);
+      _insertRecord(false, true, reason.str());
+
+      // Run the smallest failing value once more for the records it makes
+      if constexpr (std::is_invocable_v<const Property &, MTEnv &, const T &>)
+        property(*this, value);
+      return;
+    }
+    _insertRecord(true, true);
+  }
+
+  // Runs a property on one value without recording anything
+  template <typename T, typename Property>
+  bool _holds(const Property &property, const T &value, MTRecordStore &scratch)
+  {
+    if constexpr (std::is_invocable_v<const Property &, MTEnv &, const T &>)
+    {
+      MTContext *previous = _context;
+      const MTTest *test = previous != nullptr && previous->env == this
+                               ? previous->test
+                               : _currentTest;
+      MTContext trial{this, test, &scratch};
+      _context = &trial;
+      bool threw = false;
+      try {
+        property(*this, value);
+      } catch(...) {
+        threw = true;
+      }
+      _context = previous;
+      scratch.clear();
+      return !threw && !trial.failed;
+    }
+    else
+    {
+      try {
+        return bool(property(value));
+      } catch(...) {
+        return false;
+      }
+    }
+  }
+
+  // A record made by a thread a test started, and the buffer of that thread
+  struct _ThreadRecord
+  {
+    int test;
+    std::uint64_t run;
+    Record record;
+    // Consecutive passes without a reason share one entry
+    std::size_t passes;
+  };
+
+  struct _ThreadRecords
+  {
+    std::thread::id thread;
+    std::mutex mutex;
+    std::vector<_ThreadRecord> records;
+    MTStringArena strings;
+  };
+
+  // The test a thread started with start_thread belongs to, and the run of
+  // that test
+  struct _Owner
+  {
+    const MTEnv *env;
+    int test;
+    std::uint64_t run;
+  };
+
+  struct _CachedBuffer
+  {
+    std::uint64_t serial;
+    _ThreadRecords *buffer;
+  };
+
+  // Appends a record to the range of the current test, or to the store of
+  // the worker running it if any. In fail-fast mode a failure ends the test.
+  // Records made by other threads go to the buffer of the thread.
+  void _insertRecord(bool pass, bool printable, std::string_view reason = {},
+                     MTLocation where = {})
+  {
+    if (_trace)
+      _trace->assertion(where, pass);
+
+    bool worker = _context != nullptr && _context->env == this;
+    if (worker)
+    {
+      _context->records->append(0, pass, printable, reason, where);
+    }
+    else if (_otherThread())
+    {
+      // Not aborted in fail-fast mode, the failure counts when the test ends
+      _threadAppend(pass, printable, reason, where);
+      return;
+    }
+    else
+    {
+      _records.append(_currentTest->id, pass, printable, reason, where);
+    }
+
+    if (pass)
+      return;
+
+    (worker ? _context->failed : _failed) = true;
+    if (_failFast)
+      throw MTAbortTest{};
+  }
+
+  // True when the current test already failed in fail-fast mode, i.e. the
+  // abort was swallowed by the test and its assertions should be ignored
+  bool _skipping() const
+  {
+    if (!_failFast)
+      return false;
+
+    if (_context != nullptr && _context->env == this)
+      return _context->failed;
+    return !_otherThread() && _failed;
+  }
+
+  // True on a thread that is not running a test itself, e.g. one a test
+  // started
+  bool _otherThread() const
+  {
+    if (_context != nullptr && _context->env == this)
+      return false;
+    return std::this_thread::get_id() != _runThread;
+  }
+
+  // Appends a record for the test that owns the calling thread. Each thread
+  // has its own buffer, so threads of a test never wait for each other; the
+  // lock of a buffer is only taken by someone else to drain it.
+  void _threadAppend(bool pass, bool printable, std::string_view reason,
+                     MTLocation where)
+  {
+    int test = _owner.env == this ? _owner.test : _runningTest.load();
+    std::uint64_t run = _owner.env == this ? _owner.run : _runCount.load();
+    if (test < 0)
+    {
+      // Throwing would terminate the whole run from a thread we don't own
+      if (!_strayWarned.exchange(true))
+        std::cerr << "mtest: ignoring assertions from a thread of no known "
+                     "test, start it with start_thread\n";
+      return;
+    }
+
+    _ThreadRecords &buffer = _threadBuffer();
+    std::lock_guard<std::mutex> lock(buffer.mutex);
+    if (pass && reason.empty())
+    {
+      if (!buffer.records.empty() && buffer.records.back().test == test &&
+          buffer.records.back().run == run && buffer.records.back().passes != 0)
+        buffer.records.back().passes++;
+      else
+        buffer.records.push_back(
+            _ThreadRecord{test, run, Record{true, printable, 0, {}, nullptr}, 1});
+      return;
+    }
+    buffer.records.push_back(
+        _ThreadRecord{test, run, Record{pass, printable, where.line,
+                                   buffer.strings.intern(reason), where.file}, 0});
+  }
+
+  // The buffer of the calling thread, found once and then cached
+  _ThreadRecords &_threadBuffer()
+  {
+    if (_cachedBuffer.serial == _serial)
+      return *_cachedBuffer.buffer;
+
+    // A thread gets the buffer of an exited thread with the same id, so
+    // short-lived threads don't pile up buffers
+    std::lock_guard<std::mutex> lock(_buffersMutex);
+    std::thread::id self = std::this_thread::get_id();
+    _ThreadRecords *found = nullptr;
+    for (auto &buffer : _buffers)
+    {
+      if (buffer->thread == self)
+        found = buffer.get();
+    }
+    if (found == nullptr)
+    {
+      _buffers.push_back(std::make_unique<_ThreadRecords>());
+      found = _buffers.back().get();
+      found->thread = self;
+      _hasBuffers = true;
+    }
+
+    _cachedBuffer = _CachedBuffer{_serial, found};
+    return *found;
+  }
+
+  // Moves the records other threads made for a test to slot of a store and
+  // tells whether one of them failed. They come after the test's own. The
+  // records left by calls abandoned in an earlier run are dropped.
+  bool _drainThreads(int test, MTRecordStore &into, std::size_t slot)
+  {
+    if (!_hasBuffers)
+      return false;
+
+    bool failed = false;
+    std::lock_guard<std::mutex> lock(_buffersMutex);
+    for (auto &buffer : _buffers)
+    {
+      std::lock_guard<std::mutex> own(buffer->mutex);
+      auto &records = buffer->records;
+      auto kept = records.begin();
+      for (auto &it : records)
+      {
+        if (it.run != _runCount)
+          continue;
+        if (it.test != test)
+        {
+          *kept++ = it;
+          continue;
+        }
+
+        if (it.passes != 0)
+        {
+          into.count(slot, it.passes, 0);
+          continue;
+        }
+        into.append(slot, it.record.pass, it.record.printable, it.record.reason,
+                    it.record.where());
+        failed = failed || !it.record.pass;
+      }
+      records.erase(kept, records.end());
+      if (records.empty())
+        buffer->strings.clear();
+    }
+    return failed;
+  }
+
+  // True once the run reached its maximum number of failed tests
+  bool _stopping() const
+  {
+    return _maxFailures != 0 && _failedTests >= _maxFailures;
+  }
+
+  // Records a test that was not run because the run stopped early
+  void _skipTest(const MTTest &test)
+  {
+    std::stringstream reason;
+    reason << "Not run: stopped after " << _maxFailures << " failed tests";
+    _records.append(test.id, false, true, reason.str());
+    _finishTest(test.id, false);
+  }
+
+#ifdef MT_HAS_FORK
+  // A pre-forked worker process, reached through a command pipe (test indices
+  // in) and a result pipe (serialized records out).
+  struct _Worker
+  {
+    pid_t pid;
+    int command;
+    int result;
+    std::optional<std::size_t> test;
+    std::chrono::steady_clock::time_point deadline;
+  };
+
+  static bool _writeAll(int fd, const void *data, std::size_t size)
+  {
+    const char *p = static_cast<const char *>(data);
+    while (size > 0)
+    {
+      ssize_t n = write(fd, p, size);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return false;
+      p += n;
+      size -= n;
+    }
+    return true;
+  }
+
+  static bool _readAll(int fd, void *data, std::size_t size)
+  {
+    char *p = static_cast<char *>(data);
+    while (size > 0)
+    {
+      ssize_t n = read(fd, p, size);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return false;
+      p += n;
+      size -= n;
+    }
+    return true;
+  }
+
+  // Records travel as a length-prefixed frame: the resources used by the
+  // test, the numbers of kept records, passes and failures, then for each
+  // kept record its flags, its line and the length and bytes of its file and
+  // of its reason. Locations go by value so that the parent never has to
+  // trust a pointer coming from the worker.
+  static bool _writeRecords(int fd, MTRecordStore::View records,
+                            const MTResources &resources, bool retire)
+  {
+    std::string frame(sizeof(std::uint32_t), '\0');
+    auto put = [&frame](const void *data, std::size_t size) {
+      frame.append(static_cast<const char *>(data), size);
+    };
+    auto putString = [&put](std::string_view str) {
+      std::uint32_t length = str.size();
+      put(&length, sizeof(length));
+      put(str.data(), str.size());
+    };
+
+    put(&resources, sizeof(resources));
+    std::uint32_t count = records.kept();
+    std::uint64_t totals[2] = {records.passed, records.failed};
+    put(&count, sizeof(count));
+    put(totals, sizeof(totals));
+    for (const auto &rec : records)
+    {
+      char flags[2] = {rec.pass, rec.printable};
+      put(flags, sizeof(flags));
+      put(&rec.line, sizeof(rec.line));
+      putString(rec.file != nullptr ? rec.file : "");
+      putString(rec.reason);
+    }
+    char last = retire;
+    put(&last, sizeof(last));
+
+    std::uint32_t size = frame.size() - sizeof(std::uint32_t);
+    std::memcpy(&frame[0], &size, sizeof(size));
+    return _writeAll(fd, frame.data(), frame.size());
+  }
+
+  // Reads the frame of a test. retire tells whether the worker is exiting
+  // after it, e.g. because it abandoned a call that did not complete. The
+  // whole frame is checked before anything is recorded, and a malformed one
+  // fails like a crash.
+  bool _readRecords(int fd, std::size_t test, MTResources &resources,
+                    bool &retire)
+  {
+    std::uint32_t size;
+    if (!_readAll(fd, &size, sizeof(size)))
+      return false;
+
+    std::string frame(size, '\0');
+    if (!_readAll(fd, &frame[0], size))
+      return false;
+
+    std::string_view rest = frame;
+    auto get = [&rest](void *data, std::size_t size) {
+      if (size > rest.size())
+        return false;
+      std::memcpy(data, rest.data(), size);
+      rest.remove_prefix(size);
+      return true;
+    };
+    auto getString = [&rest, &get](std::string_view &str) {
+      std::uint32_t length;
+      if (!get(&length, sizeof(length)) || length > rest.size())
+        return false;
+      str = rest.substr(0, length);
+      rest.remove_prefix(length);
+      return true;
+    };
+
+    MTResources used;
+    std::uint32_t count;
+    std::uint64_t totals[2];
+    if (!get(&used, sizeof(used)) || !get(&count, sizeof(count)) ||
+        !get(totals, sizeof(totals)))
+      return false;
+
+    struct Kept
+    {
+      bool pass;
+      bool printable;
+      std::uint32_t line;
+      std::string_view file;
+      std::string_view reason;
+    };
+    std::vector<Kept> kept;
+    for (std::uint32_t i = 0; i < count; i++)
+    {
+      char flags[2];
+      Kept rec;
+      if (!get(flags, sizeof(flags)) || !get(&rec.line, sizeof(rec.line)) ||
+          !getString(rec.file) || !getString(rec.reason))
+        return false;
+
+      // Kept records are part of the totals, which must not wrap
+      rec.pass = flags[0] != 0;
+      rec.printable = flags[1] != 0;
+      if (totals[rec.pass ? 0 : 1]-- == 0)
+        return false;
+      kept.push_back(rec);
+    }
+
+    char last;
+    if (!get(&last, sizeof(last)) || !rest.empty())
+      return false;
+
+    for (const auto &rec : kept)
+    {
+      MTLocation where{_workerFile(rec.file), rec.line};
+      _records.append(test, rec.pass, rec.printable, rec.reason, where);
+    }
+    _records.count(test, totals[0], totals[1]);
+    resources = used;
+    retire = last != 0;
+    return true;
+  }
+
+  // The file of a location sent by a worker, kept once for the whole
+  // environment so that records can point at it.
+  const char *_workerFile(std::string_view file)
+  {
+    if (file.empty())
+      return nullptr;
+
+    auto it = _workerFiles.find(file);
+    if (it == _workerFiles.end())
+      it = _workerFiles.emplace(file).first;
+    return it->c_str();
+  }
+
+  _Worker _spawnWorker(const std::vector<_Worker> &others,
+                       const MTIsolation &options)
+  {
+    int command[2], result[2];
+    if (pipe(command) != 0 || pipe(result) != 0)
+      throw std::runtime_error("mtest: unable to create worker pipes");
+
+    pid_t pid = fork();
+    if (pid < 0)
+      throw std::runtime_error("mtest: unable to fork worker");
+
+    if (pid == 0)
+    {
+      // Only keep our own ends, otherwise sibling workers never see EOF
+      for (const auto &w : others)
+      {
+        close(w.command);
+        close(w.result);
+      }
+      close(command[1]);
+      close(result[0]);
+      _workerLoop(command[0], result[1], options);
+      _exit(0);
+    }
+
+    close(command[0]);
+    close(result[1]);
+    return _Worker{pid, command[1], result[0], {}, {}};
+  }
+
+  // Body of a worker process: run the test indices read from the command
+  // pipe until the parent closes it.
+  void _workerLoop(int command, int result, const MTIsolation &options)
+  {
+    _isolatedWorker = true;
+    MTRecordStore records;
+    records.keep_failures(_failuresKept);
+    std::uint32_t index;
+    while (_readAll(command, &index, sizeof(index)))
+    {
+      const MTTest &test = _tests[index];
+      bool limited = true;
+      if (options.cpuLimit.count() > 0)
+      {
+        // RLIMIT_CPU counts the whole process, so extend it from what this
+        // worker already used, rounded up to the limit's whole seconds. Only
+        // the soft limit moves: the hard one can't be raised back.
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        long micros = usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+        rlim_t used = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+                      + (micros + 999999) / 1000000;
+        rlimit limit;
+        getrlimit(RLIMIT_CPU, &limit);
+        limit.rlim_cur = used + options.cpuLimit.count();
+        if (limit.rlim_max != RLIM_INFINITY)
+          limit.rlim_cur = std::min(limit.rlim_cur, limit.rlim_max);
+        limited = setrlimit(RLIMIT_CPU, &limit) == 0;
+      }
+
+      MTContext context{this, &test, &records};
+      _context = &context;
+      _runningTest = test.id;
+      MTUsage begin = MTUsage::now();
+      if (!limited)
+      {
+        records.append(0, false, true, "Could not set the CPU time limit");
+      }
+      else
+      {
+        try {
+          test.run(*this);
+        } catch(const MTAbortTest &) {
+        } catch(...) {
+          records.append(0, false, true, "Uncaught exception");
+        }
+      }
+      MTResources resources = MTResources::between(begin, MTUsage::now());
+      _context = nullptr;
+      _drainThreads(test.id, records, 0);
+
+      std::cout.flush();
+      if (!_writeRecords(result, records.records(0), resources, _retireWorker))
+        _exit(1);
+      if (_retireWorker)
+        _exit(0);
+      records.clear();
+    }
+  }
+
+  // Records a failure for the worker's test, reaps it and forks a new one.
+  // Records the test made before dying are lost with the worker. Without
+  // what, the worker exited on its own after its test and nothing is recorded.
+  void _replaceWorker(_Worker &w, std::vector<_Worker> &workers,
+                      const MTIsolation &options, const char *what)
+  {
+    close(w.command);
+    close(w.result);
+
+    int status = 0;
+    waitpid(w.pid, &status, 0);
+
+    if (what != nullptr)
+    {
+      std::stringstream reason;
+      if (WIFSIGNALED(status) && WTERMSIG(status) == SIGXCPU)
+        what = "Test exceeded its CPU time limit";
+      reason << what;
+      if (WIFSIGNALED(status))
+        reason << " (signal " << WTERMSIG(status) << ")";
+      _records.append(*w.test, false, true, reason.str());
+    }
+
+    // The replacement must not inherit the pipes of the worker it replaces
+    w.command = w.result = -1;
+    std::vector<_Worker> others;
+    for (const auto &o : workers)
+    {
+      if (&o != &w)
+        others.push_back(o);
+    }
+    w = _spawnWorker(others, options);
+  }
+#endif
+
+  // Ends the run when an exception thrown by a test leaves run_all or
+  // run_all_parallel, so the reporters close their output and the cache is
+  // saved before it goes on
+  struct _EndOnUnwind
+  {
+    MTEnv *env;
+    int exceptions = std::uncaught_exceptions();
+
+    ~_EndOnUnwind()
+    {
+      if (std::uncaught_exceptions() <= exceptions)
+        return;
+
+      env->_currentTest = nullptr;
+      env->_runningTest = -1;
+      env->_runThread = {};
+      try {
+        env->_endRun();
+      } catch(...) {
+      }
+    }
+  };
+
+#ifdef MT_HAS_COROUTINES
+  // A coroutine test in flight on a worker of run_all_parallel
+  struct _CoRun
+  {
+    MTContext context{};
+    MTRecordStore records;
+    MTResources used{};
+    MTEventLoop::Clock::time_point start = MTEventLoop::Clock::now();
+  };
+#endif
+
+  // When the tests of a run may start: once the tests they depend on have
+  // finished, and while no running test holds one of their resources. It is
+  // not thread-safe; the parallel runner locks around it.
+  struct _Schedule
+  {
+    // Unfinished dependencies of each test, and the tests waiting on each
+    std::vector<std::size_t> blockers;
+    std::vector<std::vector<std::size_t>> dependents;
+    // Resources in use, and the tests parked until each is released
+    std::vector<bool> busy;
+    std::vector<std::vector<std::size_t>> parked;
+
+    // Takes every resource of a test, or parks the test on the first busy one
+    bool acquire(std::size_t test, const std::vector<std::size_t> &uses)
+    {
+      for (std::size_t resource : uses)
+      {
+        if (busy[resource])
+        {
+          parked[resource].push_back(test);
+          return false;
+        }
+      }
+      for (std::size_t resource : uses)
+      {
+        busy[resource] = true;
+      }
+      return true;
+    }
+
+    // Frees the resources of a finished test, adding to ready the tests parked
+    // on them and those whose last dependency it was
+    void release(std::size_t test, const std::vector<std::size_t> &uses,
+                 std::vector<std::size_t> &ready)
+    {
+      for (std::size_t resource : uses)
+      {
+        busy[resource] = false;
+        ready.insert(ready.end(), parked[resource].begin(), parked[resource].end());
+        parked[resource].clear();
+      }
+      for (std::size_t dependent : dependents[test])
+      {
+        if (--blockers[dependent] == 0)
+          ready.push_back(dependent);
+      }
+    }
+  };
+
+  const std::vector<std::size_t> &_usesOf(std::size_t id) const
+  {
+    static const std::vector<std::size_t> none;
+    return id < _uses.size() ? _uses[id] : none;
+  }
+
+  // Builds the schedule of the tests keep accepts, with the dependencies
+  // between them
+  template <typename Keep>
+  void _link(Keep keep)
+  {
+    std::size_t n = _tests.size();
+    _schedule.blockers.assign(n, 0);
+    _schedule.dependents.assign(n, {});
+    _schedule.busy.assign(_resourceIds.size(), false);
+    _schedule.parked.assign(_resourceIds.size(), {});
+    for (std::size_t test = 0; test < _after.size(); test++)
+    {
+      if (!keep(test))
+        continue;
+      for (std::size_t dependency : _after[test])
+      {
+        if (!keep(dependency))
+          continue;
+        _schedule.blockers[test]++;
+        _schedule.dependents[dependency].push_back(test);
+      }
+    }
+  }
+
+  // Orders the selected tests: shuffled or by id, each after its
+  // dependencies. Throws if they form a cycle. The schedule is linked again
+  // once the tests replayed from the cache are known.
+  void _plan()
+  {
+    std::size_t n = _tests.size();
+    _link([this](std::size_t id) { return bool(_selected[id]); });
+
+    std::vector<std::size_t> rank(n);
+    std::iota(rank.begin(), rank.end(), 0);
+    if (_shuffle)
+    {
+      MTRandom random(_seed);
+      for (std::size_t i = n; i > 1; i--)
+      {
+        std::swap(rank[i - 1], rank[random.below(i)]);
+      }
+    }
+
+    // Kahn's algorithm, taking the lowest ranked ready test first
+    auto later = [&rank](std::size_t a, std::size_t b) {
+      return rank[a] > rank[b];
+    };
+    std::vector<std::size_t> blockers = _schedule.blockers;
+    std::vector<std::size_t> heap;
+    for (std::size_t i = 0; i < n; i++)
+    {
+      if (blockers[i] == 0)
+        heap.push_back(i);
+    }
+    std::make_heap(heap.begin(), heap.end(), later);
+
+    _order.clear();
+    _order.reserve(n);
+    while (!heap.empty())
+    {
+      std::pop_heap(heap.begin(), heap.end(), later);
+      std::size_t test = heap.back();
+      heap.pop_back();
+      _order.push_back(test);
+      for (std::size_t dependent : _schedule.dependents[test])
+      {
+        if (--blockers[dependent] == 0)
+        {
+          heap.push_back(dependent);
+          std::push_heap(heap.begin(), heap.end(), later);
+        }
+      }
+    }
+
+    if (_order.size() != n)
+    {
+      for (std::size_t i = 0; i < n; i++)
+      {
+        if (blockers[i] != 0)
+          throw std::logic_error("mtest: the dependencies of " +
+                                 std::string(_tests[i].name) + " form a cycle");
+      }
+    }
+  }
+
+  // Whether a test passes the filters and belongs to the current shard
+  bool _selects(const MTTest &test) const
+  {
+    if (test.id < _firstId || test.id > _lastId)
+      return false;
+    if (_glob && !_globMatch(*_glob, test.name))
+      return false;
+    if (_nameMatches && !_nameMatches(test.name))
+      return false;
+    return _shardCount == 1 || _hash(test.name) % _shardCount == _shardIndex;
+  }
+
+  static bool _globMatch(std::string_view glob, std::string_view str)
+  {
+    // Backtracks to the character after the last * on a mismatch
+    std::size_t g = 0, i = 0;
+    std::size_t star = std::string_view::npos, mark = 0;
+    while (i < str.size())
+    {
+      if (g < glob.size() && (glob[g] == '?' || glob[g] == str[i]))
+      {
+        g++;
+        i++;
+      }
+      else if (g < glob.size() && glob[g] == '*')
+      {
+        star = g++;
+        mark = i;
+      }
+      else if (star != std::string_view::npos)
+      {
+        g = star + 1;
+        i = ++mark;
+      }
+      else
+      {
+        return false;
+      }
+    }
+
+    while (g < glob.size() && glob[g] == '*')
+      g++;
+    return g == glob.size();
+  }
+
+  static std::uint64_t _hash(std::string_view str)
+  {
+    return MTResultCache::hash(str);
+  }
+
+  // Resets the bookkeeping of the reporters for a new run. Tests that are not
+  // selected count as finished from the start.
+  void _beginRun(bool report)
+  {
+    _selected.resize(_tests.size());
+    for (const auto &test : _tests)
+    {
+      _selected[test.id] = _selects(test);
+    }
+
+    _finished = _selected;
+    _finished.flip();
+    // Each run reports only its own records, and caches only those
+    _records.clear();
+    _resources.assign(_tests.size(), MTResources{});
+    _failedTests = 0;
+    _nextReport = 0;
+    _runCount++;
+    _passedTests = 0;
+    _reportedTests = 0;
+    _score = {};
+    _categories.clear();
+    // Before any reporter starts, so a cycle leaves no half-written report
+    _plan();
+
+    _active.clear();
+    if (report)
+    {
+      // Set by MTBatch: only stream the results there
+      if (const char *path = std::getenv("MTEST_RESULTS"))
+      {
+        if (!_resultsReporter)
+        {
+          _resultsFile = std::make_unique<std::ofstream>(path);
+          _resultsReporter = std::make_unique<MTJsonLinesReporter>(*_resultsFile);
+        }
+        _active.push_back(_resultsReporter.get());
+      }
+      else
+      {
+        if (_reporters.empty())
+          _active.push_back(&_console);
+        for (auto &reporter : _reporters)
+        {
+          _active.push_back(reporter.get());
+        }
+      }
+
+      for (auto *reporter : _active)
+      {
+        reporter->begin_run(std::count(_selected.begin(), _selected.end(), true));
+      }
+    }
+    _replay();
+    _link([this](std::size_t id) { return _runs(id); });
+  }
+
+  // Replays the cached results of the selected tests whose key is unchanged
+  void _replay()
+  {
+    _replayed.assign(_tests.size(), false);
+    if (!_cache)
+      return;
+
+    for (const auto &test : _tests)
+    {
+      if (!_selected[test.id])
+        continue;
+
+      auto records = _cache->find(test.id, test.name, _cacheInput(test.name));
+      if (!records)
+        continue;
+
+      _records.append(test.id, *records);
+      if (records->failed != 0)
+        _failedTests++;
+      _replayed[test.id] = true;
+      _finishTest(test.id, false);
+    }
+  }
+
+  // Whether a test has to be run: selected and not replayed from the cache
+  bool _runs(std::size_t id) const
+  {
+    return _selected[id] && !_replayed[id];
+  }
+
+  // Marks a test as finished and hands every finished test that is next in id
+  // order to the reporters. Unless cache is false, its records are also
+  // stored in the result cache.
+  void _finishTest(std::size_t id, bool cache = true)
+  {
+    _finished[id] = true;
+    // A test without assertions is reported as failed, so it also counts
+    // toward the maximum number of failures
+    if (!_emptyTestsPass && _records.records(id).empty())
+      _failedTests++;
+    if (_cache && cache)
+      _cache->store(id, _tests[id].name, _cacheInput(_tests[id].name),
+                    _records.records(id));
+
+    for (; _nextReport < _tests.size() && _finished[_nextReport]; _nextReport++)
+    {
+      const MTTest &test = _tests[_nextReport];
+      if (!_selected[test.id])
+        continue;
+
+      // A test without assertions is reported with a single record standing
+      // for that, which is not kept in the store
+      static const MTRecord noAssertion[] = {{false, true, 0, "No assertion was made", nullptr},
+                                             {true, true, 0, "No assertion was made", nullptr}};
+      MTRecordStore::View records = _records.records(test.id);
+      bool empty = records.empty();
+      if (empty)
+      {
+        const MTRecord *rec = &noAssertion[_emptyTestsPass];
+        records = {rec, rec + 1, rec->pass ? 1u : 0u, rec->pass ? 0u : 1u};
+      }
+
+      std::size_t nPassed = records.passed;
+      bool passed = records.failed == 0;
+      _reportedTests++;
+      if (passed)
+        _passedTests++;
+
+      MTScore score;
+      score.possible = test.weight;
+      if (passed)
+        score.earned = test.weight;
+      else if (test.partial)
+        score.earned = test.weight * nPassed / records.size();
+      score.empty = empty;
+      _score += score;
+      if (!test.category.empty())
+        _categories[test.category] += score;
+
+      for (auto *reporter : _active)
+      {
+        reporter->test_done(test, records, passed, _resources[test.id]);
+      }
+    }
+  }
+
+  void _endRun()
+  {
+    if (_cache)
+      _cache->save();
+    if (_trace)
+    {
+      std::ofstream out(_tracePath);
+      _trace->write(out);
+    }
+
+    for (auto *reporter : _active)
+    {
+      reporter->end_score(_score, _categories);
+      reporter->end_run(_passedTests, _reportedTests);
+    }
+  }
+
+private:
+  // Ids are dense per environment so they index _tests and _records
+  int _idCounter = 0;
+  static inline thread_local MTContext *_context = nullptr;
+  // The entry of _tests being run by run_all
+  const MTTest *_currentTest;
+  std::vector<MTTest> _tests;
+  MTRecordStore _records;
+  MTStringArena _strings;
+
+  // Files mapped by map_file
+  std::map<std::string, std::unique_ptr<MTMappedFile>> _files;
+  std::mutex _filesMutex;
+  // Files of the locations sent by isolated workers, see _workerFile
+  std::set<std::string, std::less<>> _workerFiles;
+
+  // Fixtures, indexed by _fixtureId
+  std::vector<std::unique_ptr<_Fixture>> _fixtures;
+  std::atomic<std::uint64_t> _runCount{0};
+
+  // What each test used during the last run
+  std::vector<MTResources> _resources;
+
+  // Test selection
+  std::optional<std::string> _glob;
+  // Set by filter_regex. Type-erased so that the layout of MTEnv does not
+  // depend on MT_NO_REGEX.
+  std::function<bool(std::string_view)> _nameMatches;
+  int _firstId = 0;
+  int _lastId = INT_MAX;
+  std::size_t _shardIndex = 0;
+  std::size_t _shardCount = 1;
+  std::vector<bool> _selected;
+
+  // Result cache and the input hash of each test, see use_cache
+  std::unique_ptr<MTResultCache> _cache;
+  std::function<std::uint64_t(std::string_view)> _cacheInput;
+  std::vector<bool> _replayed;
+
+  // Records of the threads started by tests. _runThread is the thread of
+  // run_all and _runningTest the test it or an isolated worker is running.
+  std::thread::id _runThread;
+  std::atomic<int> _runningTest{-1};
+  std::vector<std::unique_ptr<_ThreadRecords>> _buffers;
+  std::mutex _buffersMutex;
+  std::atomic<bool> _hasBuffers{false};
+  std::atomic<bool> _strayWarned{false};
+  static inline thread_local _Owner _owner{nullptr, -1, 0};
+  static inline thread_local _CachedBuffer _cachedBuffer{0, nullptr};
+  // Tells environments apart in _cachedBuffer, even at the same address
+  static inline std::atomic<std::uint64_t> _instances{0};
+  const std::uint64_t _serial = ++_instances;
+
+  // Set in the processes of run_all_isolated. A worker that abandoned a call
+  // exits after its test.
+  bool _isolatedWorker = false;
+  bool _retireWorker = false;
+
+  // Seed of the property tests
+  std::uint64_t _seed = MTRandom::defaultSeed;
+
+  // Early stopping
+  bool _failFast = false;
+  std::size_t _failuresKept = std::numeric_limits<std::size_t>::max();
+  bool _failed = false;
+  std::size_t _maxFailures = 0;
+  std::atomic<std::size_t> _failedTests{0};
+
+  // Reporting state of the current run
+  MTConsoleReporter _console;
+  std::vector<std::unique_ptr<MTReporter>> _reporters;
+  std::unique_ptr<std::ofstream> _resultsFile;
+  std::unique_ptr<MTReporter> _resultsReporter;
+  std::vector<MTReporter *> _active;
+  std::vector<bool> _finished;
+  std::size_t _nextReport = 0;
+  std::size_t _passedTests = 0;
+  std::size_t _reportedTests = 0;
+
+  // Running totals of the tests reported, see _finishTest
+  MTScore _score;
+  std::map<std::string_view, MTScore> _categories;
+  bool _emptyTestsPass = false;
+
+  // Set by trace_to
+  std::unique_ptr<MTTrace> _trace;
+  std::string _tracePath;
+
+  // Run order and scheduling constraints, see _plan
+  bool _shuffle = false;
+  std::vector<std::vector<std::size_t>> _after;
+  std::map<std::string, std::size_t> _resourceIds;
+  std::vector<std::vector<std::size_t>> _uses;
+  std::vector<std::size_t> _order;
+  _Schedule _schedule;
+};
+
+// Generates a test to avoid boilerplate using the following semantics:
+// test_f("name" { ... })
 // the GravingEnv& is in the scope as env
 #define test_f(Name, Feedback, Scope)           \
   {                                             \
     Name, Feedback, [&](MTEnv & env) Scope \
-  }\
+  }
+
+// Generates a test whose body is benchmarked and must have a median runtime
+// below Budget, e.g. benchmark_f("sort", "too slow", 200ms, { ... })
+#define benchmark_f(Name, Feedback, Budget, Scope)                     \
+  {                                                                    \
+    Name, Feedback, [&](MTEnv & env) {                                 \
+      env.expect_runtime_below([&]() Scope, Budget);                   \
+    }                                                                  \
+  }
+
+// Same as test_f but for bodies that only use env. It expands to the
+// arguments of the (name, feedback, function) overload of add_test, and the
+// body is stored as a plain function pointer:
+// env.add_test(test_s("name", "feedback", { ... }));
+#define test_s(Name, Feedback, Scope) \
+  Name, Feedback, [](MTEnv & env) Scope
+
+
+// Same as test_f for the arguments of add_test_p, with each value bound to
+// Param: env.add_test_p(test_p("name", "feedback", values, x, { ... }));
+#define test_p(Name, Feedback, Values, Param, Scope) \
+  Name, Feedback, Values, [&](MTEnv & env, const auto &Param) Scope
+
+// Checks a comparison, or a value for truth, with the MTEnv& in scope as env.
+// Both operands are captured, so no template arguments are needed, and a
+// failure reads e.g. "main.cpp:12: square(x) == 10 (9 == 10)":
+// MT_CHECK(square(x) == 10);
+#define MT_CHECK(...)                                                      \
+  do                                                                       \
+  {                                                                        \
+    MT_IGNORE_PARENTHESES_BEGIN                                            \
+    env.check(MTDecomposer{} <= __VA_ARGS__, #__VA_ARGS__,                  \
+              MTLocation{__FILE__, __LINE__});                             \
+    MT_IGNORE_PARENTHESES_END                                              \
+  } while (false)
+
+// Same as test_f for the arguments of add_co_test, with the event loop in the
+// scope as loop:
+// env.add_co_test(co_test_f("name", "feedback", { co_await loop.sleep_for(1ms); }));
+#define co_test_f(Name, Feedback, Scope) \
+  Name, Feedback, [&](MTEnv & env, MTEventLoop & loop) -> MTTask Scope
+
+#endif